@@ -1,15 +1,18 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include "omp.h"
 #include "cholesky.h"
 
-const int  n = 1000; // matrix size
-const int ts = 10; // tile size
-int num_threads = 4; // number of threads to use
+int  n = 1000; // matrix size, -n or CHOLESKY_N
+int ts = 10; // tile size, -b or CHOLESKY_TS
+int num_threads = 4; // number of threads to use, -t or OMP_NUM_THREADS
+int lookahead = 1; // panels updated ahead of the trailing matrix, -l
 
 //Parallel For
 void cholesky_blocked_par_for(const int ts, const int nt, double* Ah[nt][nt])
@@ -88,6 +91,115 @@ void cholesky_task_deps(int ts, int nt, double* a[nt][nt]) {
         }
 }
 
+/*
+ * Left-looking order of cholesky_task_deps(), which is right-looking: step
+ * j applies all the updates of the panels k < j to panel j just before
+ * factorizing it. Each tile is written by a chain of updates in a row and
+ * read back by the panels to its right, so the graph is narrower but the
+ * tiles of panel j stay in cache.
+ */
+void cholesky_task_deps_left(int ts, int nt, double* a[nt][nt]) {
+
+   #pragma omp parallel
+   #pragma omp single
+        for (int j = 0; j < nt; j++) {
+                // Update panel j with the panels to its left
+                for (int k = 0; k < j; k++) {
+                        #pragma omp task depend(inout: a[j][j]) depend(in: a[k][j])
+                        syrk(a[k][j], a[j][j], ts, ts);
+                }
+                for (int i = j + 1; i < nt; i++) {
+                        for (int k = 0; k < j; k++) {
+                                #pragma omp task depend(inout: a[j][i]) depend(in: a[k][i], a[k][j])
+                                gemm(a[k][i], a[k][j], a[j][i], ts, ts);
+                        }
+                }
+                // Diagonal Block factorization
+                #pragma omp task depend(inout: a[j][j])
+                potrf(a[j][j], ts, ts);
+                // Triangular systems
+                for (int i = j + 1; i < nt; i++) {
+                        #pragma omp task depend(in: a[j][j]) depend(inout: a[j][i])
+                        trsm(a[j][j], a[j][i], ts, ts);
+                }
+        }
+}
+
+/*
+ * Crout, or top-looking, order: step i computes the row i of the factor
+ * from the rows above it, tile by tile from left to right, and then its
+ * diagonal tile. Each step reads the whole factor computed so far but
+ * writes a single row, the least parallel of the three orders and the one
+ * with the smallest working set of written tiles.
+ */
+void cholesky_task_deps_crout(int ts, int nt, double* a[nt][nt]) {
+
+   #pragma omp parallel
+   #pragma omp single
+        for (int i = 0; i < nt; i++) {
+                // Row i of the factor, left to right
+                for (int j = 0; j < i; j++) {
+                        for (int k = 0; k < j; k++) {
+                                #pragma omp task depend(inout: a[j][i]) depend(in: a[k][i], a[k][j])
+                                gemm(a[k][i], a[k][j], a[j][i], ts, ts);
+                        }
+                        #pragma omp task depend(in: a[j][j]) depend(inout: a[j][i])
+                        trsm(a[j][j], a[j][i], ts, ts);
+                }
+                // Diagonal Block update and factorization
+                for (int k = 0; k < i; k++) {
+                        #pragma omp task depend(inout: a[i][i]) depend(in: a[k][i])
+                        syrk(a[k][i], a[i][i], ts, ts);
+                }
+                #pragma omp task depend(inout: a[i][i])
+                potrf(a[i][i], ts, ts);
+        }
+}
+
+/*
+ * cholesky_task_deps() with the critical path first. Step k creates the
+ * updates of the next lookahead panels, which the next potrf and trsm
+ * wait for, before the rest of the trailing matrix. The priorities follow
+ * the critical path too: potrf, then trsm, then the updates of the
+ * lookahead panels and the syrk on the next diagonal tile, then the
+ * remaining gemm and syrk; they only count with OMP_MAX_TASK_PRIORITY=3
+ * or more. Within a step the tasks write different tiles, so any order
+ * gives the same result.
+ */
+void cholesky_task_deps_lookahead(int ts, int nt, double* a[nt][nt], int lookahead) {
+
+   #pragma omp parallel
+   #pragma omp single
+        for (int k = 0; k < nt; k++) {
+                // Diagonal Block factorization
+                #pragma omp task depend(inout: a[k][k]) priority(3)
+                potrf(a[k][k], ts, ts);
+                // Triangular systems
+                for (int i = k + 1; i < nt; i++) {
+                        #pragma omp task depend(in: a[k][k]) depend(inout: a[k][i]) priority(2)
+                        trsm(a[k][k], a[k][i], ts, ts);
+                }
+                // Update the next panels j, a[j][j] and a[j][i] below it
+                const int ahead = (k + lookahead < nt - 1) ? k + lookahead : nt - 1;
+                for (int j = k + 1; j <= ahead; j++) {
+                        #pragma omp task depend(inout: a[j][j]) depend(in: a[k][j]) priority(1)
+                        syrk(a[k][j], a[j][j], ts, ts);
+                        for (int i = j + 1; i < nt; i++) {
+                                #pragma omp task depend(inout: a[j][i]) depend(in: a[k][i], a[k][j]) priority(1)
+                                gemm(a[k][i], a[k][j], a[j][i], ts, ts);
+                        }
+                }
+                // Update the rest of the trailing matrix
+                for (int i = ahead + 1; i < nt; i++) {
+                        for (int j = ahead + 1; j < i; j++) {
+                                #pragma omp task depend(inout: a[j][i]) depend(in: a[k][i], a[k][j])
+                                gemm(a[k][i], a[k][j], a[j][i], ts, ts);
+                        }
+                        #pragma omp task depend(inout: a[i][i]) depend(in: a[k][i]) priority(i == k + 1)
+                        syrk(a[k][i], a[i][i], ts, ts);
+                }
+        }
+}
 
 //Sequential
 void cholesky_blocked(const int ts, const int nt, double* Ah[nt][nt])
@@ -122,8 +234,67 @@ void print_matrix(int n, double * const matrix){
 	printf("};\n");
 }
 
+static void usage(char *s)
+{
+   fprintf(stderr, "Usage: %s [-n matrix size] [-b tile size] [-t threads] [-k auto|blas|native]\n"
+           "       [-l lookahead] [-i]\n", s);
+}
+
+// with -i, thread time outside the tile kernels during time seconds
+static void idle_start(void)
+{
+   if (kernel_busy)
+      memset(kernel_busy, 0, num_threads * BUSY_PAD * sizeof(double));
+}
+
+static float idle_time(const float time)
+{
+   double busy = 0.0;
+   for (int t = 0; t < num_threads; t++)
+      busy += kernel_busy[t * BUSY_PAD];
+   return num_threads * time - busy;
+}
+
 int main(int argc, char* argv[])
 {
+   // the environment, then the command line
+   if (getenv("CHOLESKY_N")) n = atoi(getenv("CHOLESKY_N"));
+   if (getenv("CHOLESKY_TS")) ts = atoi(getenv("CHOLESKY_TS"));
+   if (getenv("OMP_NUM_THREADS")) num_threads = omp_get_max_threads();
+
+   // tile kernels, by default the faster for this tile size
+   const char *kernels = HAVE_BLAS ? "auto" : "native";
+
+   int idle = 0;
+
+   int opt;
+   while ((opt = getopt(argc, argv, "n:b:t:k:l:i")) != -1) {
+      switch (opt) {
+      case 'n': n = atoi(optarg); break;
+      case 'b': ts = atoi(optarg); break;
+      case 't': num_threads = atoi(optarg); break;
+      case 'k': kernels = optarg; break;
+      case 'l': lookahead = atoi(optarg); break;
+      case 'i': idle = 1; break;
+      default:
+         usage(argv[0]);
+         return 1;
+      }
+   }
+   if (n < 1 || ts < 1 || ts > n || num_threads < 1 || lookahead < 0) {
+      usage(argv[0]);
+      return 1;
+   }
+   // the matrices are indexed with int, like the n of dlarnv
+   if (n > INT_MAX / n) {
+      fprintf(stderr, "Matrix size must be at most %d\n", 46340);
+      return 1;
+   }
+   if (strcmp(kernels, "native") && (!HAVE_BLAS || (strcmp(kernels, "blas") && strcmp(kernels, "auto")))) {
+      fprintf(stderr, "Tile kernels must be native%s\n", HAVE_BLAS ? ", blas or auto" : " without a BLAS library");
+      return 1;
+   }
+   native_kernels = !strcmp(kernels, "native");
 
    omp_set_num_threads(num_threads);
    // Allocate matrix
@@ -141,17 +312,14 @@ int main(int argc, char* argv[])
    double * const expected_matrix = (double *) malloc(n * n * sizeof(double));
    assert(expected_matrix != NULL);
 
-   const int nt = n / ts;
-
-   // Allocate blocked matrix
-   double *Ah[nt][nt];
+   // the last tiles take the remainder, padded as convert_to_blocks() explains
+   const int nt = (n + ts - 1) / ts;
 
-   for (int i = 0; i < nt; i++) {
-      for (int j = 0; j < nt; j++) {
-         Ah[i][j] = malloc(ts * ts * sizeof(double));
-         assert(Ah[i][j] != NULL);
-      }
-   }
+   // Allocate blocked matrix, a view of the tiles of one arena
+   double *(*Ah)[nt] = malloc(nt * nt * sizeof(double *));
+   assert(Ah != NULL);
+   double * const tiles = alloc_tiles(ts, nt, Ah);
+   assert(tiles != NULL);
 
    for (int i = 0; i < n * n; i++ ) {
       original_matrix[i] = matrix[i];
@@ -161,6 +329,18 @@ int main(int argc, char* argv[])
    // warming up libraries
    cholesky_blocked(ts, nt, (double* (*)[nt]) Ah);
    convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   // with -k auto the kernels of the faster warm-up factorization are used
+   float kernel_time[2];
+   if (!strcmp(kernels, "auto")) {
+      for (int native = 0; native < 2; native++) {
+         native_kernels = native;
+         float t0 = get_time();
+         cholesky_blocked(ts, nt, (double* (*)[nt]) Ah);
+         kernel_time[native] = get_time() - t0;
+         convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+      }
+      native_kernels = kernel_time[1] < kernel_time[0];
+   }
    // done warming up
    float t1 = get_time();
    //run sequential version
@@ -177,6 +357,12 @@ int main(int argc, char* argv[])
    }
    // End Sequential
 
+   // the parallel versions also measure the time threads are idle
+   if (idle) {
+      kernel_busy = calloc(num_threads * BUSY_PAD, sizeof(double));
+      assert(kernel_busy != NULL);
+   }
+
    /*************************************************************************************************************
     * NOTE FOR STUDENTS: 
     * COPY the following code (between multiline comments, up to "End Parallel For") to invoke your versio
@@ -196,12 +382,14 @@ int main(int argc, char* argv[])
    }
    //require to work with blocks
    convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   idle_start();
    t1 = get_time();
    //run parallel version using parallel fors
    cholesky_blocked_par_for(ts, nt, (double* (*)[nt]) Ah);
    t2 = get_time() - t1;
    //calculate timing metrics
    float par_for_time = t2;
+   float par_for_idle = kernel_busy ? idle_time(t2) : 0.0;
    float par_for_gflops = (((1.0 / 3.0) * n * n * n) / ((par_for_time) * 1.0e+9));
 
    //asserting result, comparing the output to the expect matrix
@@ -221,12 +409,14 @@ int main(int argc, char* argv[])
    }
    //require to work with blocks
    convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   idle_start();
    t1 = get_time();
    //run parallel version using parallel fors
    cholesky_task(ts, nt, (double* (*)[nt]) Ah);
    t2 = get_time() - t1;
    //calculate timing metrics
    float task_time = t2;
+   float task_idle = kernel_busy ? idle_time(t2) : 0.0;
    float task_gflops = (((1.0 / 3.0) * n * n * n) / ((task_time) * 1.0e+9));
 
    //asserting result, comparing the output to the expect matrix
@@ -246,12 +436,14 @@ int main(int argc, char* argv[])
    }
    //require to work with blocks
    convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   idle_start();
    t1 = get_time();
-   //run parallel version using parallel fors
+   //run parallel version using tasks with dependences, right-looking order
    cholesky_task_deps(ts, nt, (double* (*)[nt]) Ah);
    t2 = get_time() - t1;
    //calculate timing metrics
    float task_dep_time = t2;
+   float task_dep_idle = kernel_busy ? idle_time(t2) : 0.0;
    float task_dep_gflops = (((1.0 / 3.0) * n * n * n) / ((task_dep_time) * 1.0e+9));
 
    //asserting result, comparing the output to the expect matrix
@@ -262,32 +454,132 @@ int main(int argc, char* argv[])
     * End Parallel Task with dependencies
     *****************************************************************************************************/
 
+/*****************************************************************************************************
+    * Parallel Task with dependencies, left-looking
+    *****************************************************************************************************/
+   //resetting matrix
+   for (int i = 0; i < n * n; i++ ) {
+      matrix[i] = original_matrix[i];
+   }
+   //require to work with blocks
+   convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   idle_start();
+   t1 = get_time();
+   //run parallel version using tasks with dependences, left-looking order
+   cholesky_task_deps_left(ts, nt, (double* (*)[nt]) Ah);
+   t2 = get_time() - t1;
+   //calculate timing metrics
+   float left_time = t2;
+   float left_idle = kernel_busy ? idle_time(t2) : 0.0;
+   float left_gflops = (((1.0 / 3.0) * n * n * n) / ((left_time) * 1.0e+9));
+
+   //asserting result, comparing the output to the expect matrix
+   convert_to_linear(ts, nt, n, Ah, (double (*)[n]) matrix);
+   assert_matrix(n,matrix,expected_matrix);
+
+   /*****************************************************************************************************
+    * End Parallel Task with dependencies, left-looking
+    *****************************************************************************************************/
+
+/*****************************************************************************************************
+    * Parallel Task with dependencies, Crout
+    *****************************************************************************************************/
+   //resetting matrix
+   for (int i = 0; i < n * n; i++ ) {
+      matrix[i] = original_matrix[i];
+   }
+   //require to work with blocks
+   convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   idle_start();
+   t1 = get_time();
+   //run parallel version using tasks with dependences, Crout order
+   cholesky_task_deps_crout(ts, nt, (double* (*)[nt]) Ah);
+   t2 = get_time() - t1;
+   //calculate timing metrics
+   float crout_time = t2;
+   float crout_idle = kernel_busy ? idle_time(t2) : 0.0;
+   float crout_gflops = (((1.0 / 3.0) * n * n * n) / ((crout_time) * 1.0e+9));
+
+   //asserting result, comparing the output to the expect matrix
+   convert_to_linear(ts, nt, n, Ah, (double (*)[n]) matrix);
+   assert_matrix(n,matrix,expected_matrix);
+
+   /*****************************************************************************************************
+    * End Parallel Task with dependencies, Crout
+    *****************************************************************************************************/
+
+/*****************************************************************************************************
+    * Parallel Task with dependencies, lookahead and priorities
+    *****************************************************************************************************/
+   //resetting matrix
+   for (int i = 0; i < n * n; i++ ) {
+      matrix[i] = original_matrix[i];
+   }
+   //require to work with blocks
+   convert_to_blocks(ts, nt, n, (double(*)[n]) matrix, Ah);
+   idle_start();
+   t1 = get_time();
+   //run parallel version using tasks with dependences, critical path first
+   cholesky_task_deps_lookahead(ts, nt, (double* (*)[nt]) Ah, lookahead);
+   t2 = get_time() - t1;
+   //calculate timing metrics
+   float lookahead_time = t2;
+   float lookahead_idle = kernel_busy ? idle_time(t2) : 0.0;
+   float lookahead_gflops = (((1.0 / 3.0) * n * n * n) / ((lookahead_time) * 1.0e+9));
+
+   //asserting result, comparing the output to the expect matrix
+   convert_to_linear(ts, nt, n, Ah, (double (*)[n]) matrix);
+   assert_matrix(n,matrix,expected_matrix);
+
+   /*****************************************************************************************************
+    * End Parallel Task with dependencies, lookahead and priorities
+    *****************************************************************************************************/
+
 
    // Print result
    printf( "============ CHOLESKY RESULTS ============\n" );
    printf( "  matrix size:                  %dx%d\n", n, n);
    printf( "  block size:                   %dx%d\n", ts, ts);
+   printf( "  number of blocks:             %dx%d (last %dx%d)\n", nt, nt, n - (nt-1)*ts, n - (nt-1)*ts);
    printf( "  number of threads:            %d\n", num_threads);
+   printf( "  tile kernels:                 %s%s\n", native_kernels ? "native" : "blas",
+           strcmp(kernels, "auto") ? "" : " (auto)");
    printf( "  seq_time (s):                 %f\n", seq_time);
    printf( "  seq_performance (gflops):     %f\n", seq_gflops);
    printf( "  par_for_time (s):             %f\n", par_for_time);
    printf( "  par_for_performance (gflops): %f\n", par_for_gflops);
+   if (idle)
+      printf( "  par_for_idle (s):             %f (%.1f%%)\n", par_for_idle, 100.0 * par_for_idle / (num_threads * par_for_time));
    printf( "  task_time (s):                %f\n", task_time);
    printf( "  task_performance (gflops):    %f\n", task_gflops);
+   if (idle)
+      printf( "  task_idle (s):                %f (%.1f%%)\n", task_idle, 100.0 * task_idle / (num_threads * task_time));
    printf( "  task_dep_time (s):            %f\n", task_dep_time);
    printf( "  task_dep_performance (gflops):%f\n", task_dep_gflops);
+   if (idle)
+      printf( "  task_dep_idle (s):            %f (%.1f%%)\n", task_dep_idle, 100.0 * task_dep_idle / (num_threads * task_dep_time));
+   printf( "  left_time (s):                %f\n", left_time);
+   printf( "  left_performance (gflops):    %f\n", left_gflops);
+   if (idle)
+      printf( "  left_idle (s):                %f (%.1f%%)\n", left_idle, 100.0 * left_idle / (num_threads * left_time));
+   printf( "  crout_time (s):               %f\n", crout_time);
+   printf( "  crout_performance (gflops):   %f\n", crout_gflops);
+   if (idle)
+      printf( "  crout_idle (s):               %f (%.1f%%)\n", crout_idle, 100.0 * crout_idle / (num_threads * crout_time));
+   printf( "  lookahead_depth:              %d\n", lookahead);
+   printf( "  lookahead_time (s):           %f\n", lookahead_time);
+   printf( "  lookahead_performance (gflops):%f\n", lookahead_gflops);
+   if (idle)
+      printf( "  lookahead_idle (s):           %f (%.1f%%)\n", lookahead_idle, 100.0 * lookahead_idle / (num_threads * lookahead_time));
    printf( "==========================================\n" );
 
 
+   free(kernel_busy);
    free(original_matrix);
    free(expected_matrix);
    // Free blocked matrix
-   for (int i = 0; i < nt; i++) {
-      for (int j = 0; j < nt; j++) {
-         assert(Ah[i][j] != NULL);
-         free(Ah[i][j]);
-      }
-   }
+   free(tiles);
+   free(Ah);
    // Free matrix
    free(matrix);
 
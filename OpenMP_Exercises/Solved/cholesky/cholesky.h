@@ -1,11 +1,44 @@
 #include <math.h>
+#if defined(CHOLESKY_MKL)
 #include <mkl/mkl.h>
+#endif
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/times.h>
 
+// tile kernels of a BLAS/LAPACK library, next to the native ones below
+#if defined(CHOLESKY_MKL) || defined(CHOLESKY_OPENBLAS)
+#define HAVE_BLAS 1
+#else
+#define HAVE_BLAS 0
+#endif
 
 double threshold = 0.1;
 
+// the tile kernels in use: the native ones, or those of the library
+int native_kernels = !HAVE_BLAS;
+
+// time every thread spent in the tile kernels, BUSY_PAD doubles apart so
+// that threads do not share lines; NULL unless idle time is measured
+#define BUSY_PAD 8
+double *kernel_busy = NULL;
+
+static inline double busy_start(void)
+{
+   return kernel_busy ? omp_get_wtime() : 0.0;
+}
+
+static inline void busy_stop(const double t0)
+{
+   if (kernel_busy)
+      kernel_busy[omp_get_thread_num() * BUSY_PAD] += omp_get_wtime() - t0;
+}
+
+#if defined(CHOLESKY_OPENBLAS)
+void dpotrf_ (const char *uplo, int *n, double *a, int *lda, int *info);
+void dlarnv_ (int *idist, int *iseed, const int *n, double *x);
+#endif
+
 void dgemm_ (const char *transa, const char *transb, int *l, int *n, int *m, double *alpha,
              const void *a, int *lda, void *b, int *ldb, double *beta, void *c, int *ldc);
 void dtrsm_ (char *side, char *uplo, char *transa, char *diag, int *m, int *n, double *alpha,
@@ -52,12 +85,21 @@ float get_time()
 
 void initialize_matrix(const int n, const int ts, double *matrix)
 {
+#if HAVE_BLAS
 	int ISEED[4] = {0,0,0,1};
 	int intONE=1;
 
 	for (int i = 0; i < n*n; i+=n) {
 		dlarnv_(&intONE, &ISEED[0], &n, &matrix[i]);
 	}
+#else
+	// uniform (0,1) like dlarnv, from a 64-bit LCG
+	unsigned long long seed = 1;
+	for (int i = 0; i < n*n; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		matrix[i] = ((seed >> 11) + 0.5) / 9007199254740992.0;
+	}
+#endif
 
 	for (int i=0; i<n; i++) {
 		for (int j=0; j<n; j++) {
@@ -69,35 +111,58 @@ void initialize_matrix(const int n, const int ts, double *matrix)
 	add_to_diag(matrix, n, (double) n);
 }
 
-static void gather_block(const int N, const int ts, double *Alin, double *A)
+/*
+ * The last tiles of the matrix cover the remainder of N / ts: only rows x
+ * cols of them are in the matrix. The rest of an edge tile is the identity
+ * on the diagonal tiles and zero elsewhere, so that the padded matrix is
+ * diag(A, I), its factor is diag(L, I), and the tile kernels always work
+ * on full tiles.
+ */
+static void gather_block(const int N, const int ts, const int rows, const int cols, const int diag,
+                         double *Alin, double * restrict A)
 {
-	for (int i = 0; i < ts; i++)
-		for (int j = 0; j < ts; j++) {
-			A[i*ts + j] = Alin[i*N + j];
-		}
+	for (int i = 0; i < ts; i++) {
+		const double * restrict row = &Alin[i*N];
+		const int valid = (i < rows) ? cols : 0;
+		#pragma omp simd
+		for (int j = 0; j < valid; j++)
+			A[i*ts + j] = row[j];
+		for (int j = valid; j < ts; j++)
+			A[i*ts + j] = (diag && i == j) ? 1.0 : 0.0;
+	}
 }
 
-static void scatter_block(const int N, const int ts, double *A, double *Alin)
+static void scatter_block(const int N, const int ts, const int rows, const int cols,
+                          double * restrict A, double *Alin)
 {
-	for (int i = 0; i < ts; i++)
-		for (int j = 0; j < ts; j++) {
-			Alin[i*N + j] = A[i*ts + j];
-		}
+	for (int i = 0; i < rows; i++) {
+		double * restrict row = &Alin[i*N];
+		#pragma omp simd
+		for (int j = 0; j < cols; j++)
+			row[j] = A[i*ts + j];
+	}
 }
 
+// the tiles are copied in parallel, each thread touching the same tiles in both directions
 static void convert_to_blocks(const int ts, const int DIM, const int N, double Alin[N][N], double *A[DIM][DIM])
 {
+	#pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < DIM; i++)
 		for (int j = 0; j < DIM; j++) {
-			gather_block ( N, ts, &Alin[i*ts][j*ts], A[i][j]);
+			const int rows = (N - i*ts < ts) ? N - i*ts : ts;
+			const int cols = (N - j*ts < ts) ? N - j*ts : ts;
+			gather_block ( N, ts, rows, cols, i == j, &Alin[i*ts][j*ts], A[i][j]);
 		}
 }
 
 static void convert_to_linear(const int ts, const int DIM, const int N, double *A[DIM][DIM], double Alin[N][N])
 {
+	#pragma omp parallel for collapse(2) schedule(static)
 	for (int i = 0; i < DIM; i++)
 		for (int j = 0; j < DIM; j++) {
-			scatter_block ( N, ts, A[i][j], (double *) &Alin[i*ts][j*ts]);
+			const int rows = (N - i*ts < ts) ? N - i*ts : ts;
+			const int cols = (N - j*ts < ts) ? N - j*ts : ts;
+			scatter_block ( N, ts, rows, cols, A[i][j], (double *) &Alin[i*ts][j*ts]);
 		}
 }
 
@@ -109,35 +174,237 @@ static double * malloc_block (const int ts)
 	return block;
 }
 
+/*
+ * All the tiles in one region instead of a malloc per tile. Every tile
+ * starts a cache line, and the tiles follow the order in which the
+ * right-looking factorization uses them: panel k is a[k][k] followed by
+ * a[k][k+1..nt-1], so each panel is contiguous and the next one starts
+ * right after it. The tiles below the diagonal, which the factorization
+ * never reads, come last. A region of a huge page or more is aligned to
+ * one and advised to use them. Returns the region, to free(), and fills
+ * A with the tiles.
+ */
+#define TILE_ALIGN 64
+#define HUGE_PAGE  (2 << 20)
+
+static double * alloc_tiles(const int ts, const int nt, double *A[nt][nt])
+{
+	const size_t line = TILE_ALIGN / sizeof(double);
+	const size_t stride = ((size_t) ts * ts + line - 1) / line * line;
+	const size_t bytes = stride * nt * nt * sizeof(double);
+	const size_t align = (bytes >= HUGE_PAGE) ? HUGE_PAGE : TILE_ALIGN;
+	void *arena;
+
+	if (posix_memalign(&arena, align, bytes))
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (align == HUGE_PAGE)
+		madvise(arena, bytes, MADV_HUGEPAGE);
+#endif
+
+	double *tile = (double *) arena;
+	for (int k = 0; k < nt; k++)
+		for (int j = k; j < nt; j++, tile += stride)
+			A[k][j] = tile;
+	for (int i = 1; i < nt; i++)
+		for (int j = 0; j < i; j++, tile += stride)
+			A[i][j] = tile;
+
+	return (double *) arena;
+}
+
+
 
 
+/*
+ * Native tile kernels, with the column-major tiles and the semantics of
+ * the LAPACK and BLAS calls below: only the lower triangle of a diagonal
+ * tile is read and written. They are written for the compiler to
+ * vectorize down the columns, which are contiguous, and NATIVE() calls
+ * inlined copies for the common tile sizes, so the loops have constant
+ * trip counts. gemm and syrk work on 8x4 blocks of C kept in registers
+ * (one AVX-512 or two AVX2 vectors per column of 8 doubles, four or eight
+ * for the block) while they run through the whole k dimension; other
+ * sizes take the plain loops.
+ */
+#define MR 8
+#define NR 4
+
+#define INLINE static inline __attribute__((always_inline))
+
+#define NATIVE(kernel, ts, ld, ...)                                 \
+   switch ((ts) == (ld) ? (ts) : 0) {                              \
+   case  8: kernel( 8,  8, __VA_ARGS__); break;                    \
+   case 16: kernel(16, 16, __VA_ARGS__); break;                    \
+   case 32: kernel(32, 32, __VA_ARGS__); break;                    \
+   case 64: kernel(64, 64, __VA_ARGS__); break;                    \
+   default: kernel(ts, ld, __VA_ARGS__); break;                    \
+   }
+
+// A = L L^T, left-looking by columns
+INLINE void potrf_native(const int ts, const int ld, double * restrict A)
+{
+   for (int j = 0; j < ts; j++) {
+      for (int l = 0; l < j; l++) {
+         const double a = A[l*ld + j];
+         #pragma omp simd
+         for (int i = j; i < ts; i++)
+            A[j*ld + i] -= A[l*ld + i] * a;
+      }
+      const double d = sqrt(A[j*ld + j]);
+      const double r = 1.0 / d;
+      A[j*ld + j] = d;
+      #pragma omp simd
+      for (int i = j + 1; i < ts; i++)
+         A[j*ld + i] *= r;
+   }
+}
+
+// B = B L^-T with L the lower triangle of A, a column of B at a time
+INLINE void trsm_native(const int ts, const int ld, const double * restrict A, double * restrict B)
+{
+   for (int j = 0; j < ts; j++) {
+      for (int l = 0; l < j; l++) {
+         const double a = A[l*ld + j];
+         #pragma omp simd
+         for (int i = 0; i < ts; i++)
+            B[j*ld + i] -= B[l*ld + i] * a;
+      }
+      const double r = 1.0 / A[j*ld + j];
+      #pragma omp simd
+      for (int i = 0; i < ts; i++)
+         B[j*ld + i] *= r;
+   }
+}
+
+// C[i..i+MR][j..j+NR] -= A[i..i+MR][:] B[j..j+NR][:]^T
+INLINE void gemm_micro(const int ts, const int ld, const double * restrict A, const double * restrict B,
+                       double * restrict C, const int i, const int j)
+{
+   double c[NR][MR];
+   for (int jj = 0; jj < NR; jj++)
+      #pragma omp simd
+      for (int ii = 0; ii < MR; ii++)
+         c[jj][ii] = C[(j+jj)*ld + i + ii];
+
+   for (int l = 0; l < ts; l++) {
+      const double * restrict a = &A[l*ld + i];
+      for (int jj = 0; jj < NR; jj++) {
+         const double b = B[l*ld + j + jj];
+         #pragma omp simd
+         for (int ii = 0; ii < MR; ii++)
+            c[jj][ii] -= a[ii] * b;
+      }
+   }
+
+   for (int jj = 0; jj < NR; jj++)
+      #pragma omp simd
+      for (int ii = 0; ii < MR; ii++)
+         C[(j+jj)*ld + i + ii] = c[jj][ii];
+}
+
+// C -= A B^T
+INLINE void gemm_native(const int ts, const int ld, const double * restrict A, const double * restrict B,
+                        double * restrict C)
+{
+   if (ts % MR == 0) {
+      for (int j = 0; j < ts; j += NR)
+         for (int i = 0; i < ts; i += MR)
+            gemm_micro(ts, ld, A, B, C, i, j);
+      return;
+   }
+   for (int j = 0; j < ts; j++)
+      for (int l = 0; l < ts; l++) {
+         const double b = B[l*ld + j];
+         #pragma omp simd
+         for (int i = 0; i < ts; i++)
+            C[j*ld + i] -= A[l*ld + i] * b;
+      }
+}
+
+// lower triangle of C -= A A^T; the blocks below the diagonal are gemm's
+INLINE void syrk_native(const int ts, const int ld, const double * restrict A, double * restrict C)
+{
+   if (ts % MR == 0) {
+      for (int j = 0; j < ts; j += NR)
+         for (int i = j / MR * MR; i < ts; i += MR) {
+            if (i >= j + NR - 1) {
+               gemm_micro(ts, ld, A, A, C, i, j);
+               continue;
+            }
+            // the block crosses the diagonal
+            for (int jj = j; jj < j + NR; jj++)
+               for (int l = 0; l < ts; l++) {
+                  const double b = A[l*ld + jj];
+                  for (int ii = (i > jj) ? i : jj; ii < i + MR; ii++)
+                     C[jj*ld + ii] -= A[l*ld + ii] * b;
+               }
+         }
+      return;
+   }
+   for (int j = 0; j < ts; j++)
+      for (int l = 0; l < ts; l++) {
+         const double b = A[l*ld + j];
+         #pragma omp simd
+         for (int i = j; i < ts; i++)
+            C[j*ld + i] -= A[l*ld + i] * b;
+      }
+}
 
 static void potrf(double * const A, int ts, int ld)
 {
-   static int INFO;
-   static const char L = 'L';
-   dpotrf_(&L, &ts, A, &ld, &INFO);
+   const double t0 = busy_start();
+#if HAVE_BLAS
+   if (!native_kernels) {
+      int INFO;
+      static const char L = 'L';
+      dpotrf_(&L, &ts, A, &ld, &INFO);
+   } else
+#endif
+   NATIVE(potrf_native, ts, ld, A);
+   busy_stop(t0);
 }
 
 static void trsm(double *A, double *B, int ts, int ld)
 {
-   static char LO = 'L', TR = 'T', NU = 'N', RI = 'R';
-   static double DONE = 1.0;
-   dtrsm_(&RI, &LO, &TR, &NU, &ts, &ts, &DONE, A, &ld, B, &ld );
+   const double t0 = busy_start();
+#if HAVE_BLAS
+   if (!native_kernels) {
+      static char LO = 'L', TR = 'T', NU = 'N', RI = 'R';
+      static double DONE = 1.0;
+      dtrsm_(&RI, &LO, &TR, &NU, &ts, &ts, &DONE, A, &ld, B, &ld );
+   } else
+#endif
+   NATIVE(trsm_native, ts, ld, A, B);
+   busy_stop(t0);
 }
 
 static void syrk(double *A, double *B, int ts, int ld)
 {
-   static char LO = 'L', NT = 'N';
-   static double DONE = 1.0, DMONE = -1.0;
-   dsyrk_(&LO, &NT, &ts, &ts, &DMONE, A, &ld, &DONE, B, &ld );
+   const double t0 = busy_start();
+#if HAVE_BLAS
+   if (!native_kernels) {
+      static char LO = 'L', NT = 'N';
+      static double DONE = 1.0, DMONE = -1.0;
+      dsyrk_(&LO, &NT, &ts, &ts, &DMONE, A, &ld, &DONE, B, &ld );
+   } else
+#endif
+   NATIVE(syrk_native, ts, ld, A, B);
+   busy_stop(t0);
 }
 
 static void gemm(double *A, double *B, double *C, int ts, int ld)
 {
-   static const char TR = 'T', NT = 'N';
-   static double DONE = 1.0, DMONE = -1.0;
-   dgemm_(&NT, &TR, &ts, &ts, &ts, &DMONE, A, &ld, B, &ld, &DONE, C, &ld);
+   const double t0 = busy_start();
+#if HAVE_BLAS
+   if (!native_kernels) {
+      static const char TR = 'T', NT = 'N';
+      static double DONE = 1.0, DMONE = -1.0;
+      dgemm_(&NT, &TR, &ts, &ts, &ts, &DMONE, A, &ld, B, &ld, &DONE, C, &ld);
+   } else
+#endif
+   NATIVE(gemm_native, ts, ld, A, B, C);
+   busy_stop(t0);
 }
 
 
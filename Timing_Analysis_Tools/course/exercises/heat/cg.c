@@ -0,0 +1,244 @@
+//
+// This file is part of Heat Gauss Seidel  and is licensed under the terms contained in the COPYING file.
+// Copyright (C) 2015-2020 Barcelona Supercomputing Center (BSC)
+//
+
+/*
+ * Conjugate gradient for the steady state of the heat problem (algorithm
+ * 3): A u = b with A the 5-point Laplacian 4u - sum(neighbours) on the
+ * interior and b the neighbours on the boundary. The residual b - Au is
+ * then sum(neighbours) - 4u over u itself, boundary included, and the
+ * search directions p keep a zero boundary, so A is applied matrix-free on
+ * the layout of u. Every call does one iteration.
+ *
+ * All the work is block tasks on the blocks of the other solvers, with
+ * the grid addresses u[inf_i][inf_j], r[..], p[..] and q[..] as tokens.
+ * The dot products are reduced through dependences rather than taskgroup
+ * reductions: every block task writes its partial sum into its own slot,
+ * and a task that depends on all the slots adds them in block order, so the
+ * sums do not depend on the schedule, and computes the scalar the next
+ * tasks depend on. Those are the only points where the blocks meet, which
+ * CG needs anyway, and the producer creates whole iterations without
+ * waiting.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "heat.h"
+
+typedef struct
+{
+    real_t *r, *p, *q;      // residual, search direction, A p
+    double *pq, *rr;        // partial dot products, one per block
+    double rho;             // r.r of the current residual
+    double alpha, beta;
+    unsigned np;
+}
+cg_t;
+
+/*
+ * Start CG from u: r = p = b - A u, and rho = r.r.
+ */
+static void cg_start( cg_t *cg, real_t *u, int np, int nbx, int nby )
+{
+    real_t *r = cg->r, *p = cg->p;
+    double *rr = cg->rr, *rho = &cg->rho;
+    int bx = block_size(np - 2, nbx);
+    int by = block_size(np - 2, nby);
+    int ld = GRID_PITCH(np);
+    int nb = nbx * nby;
+
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = 1 + ii * bx;
+            int sup_i = ((inf_i + bx) < np - 1) ? inf_i + bx : np - 1;
+            int inf_j = 1 + jj * by;
+            int sup_j = ((inf_j + by) < np - 1) ? inf_j + by : np - 1;
+            int b = ii * nby + jj;
+            #pragma omp task depend(in: u[inf_i*ld+inf_j],      \
+                                        u[(inf_i-bx)*ld+inf_j], \
+                                        u[sup_i*ld+inf_j],      \
+                                        u[inf_i*ld+inf_j-by],   \
+                                        u[inf_i*ld+sup_j])      \
+                             depend(out: r[inf_i*ld+inf_j], p[inf_i*ld+inf_j], rr[b]) \
+                             firstprivate(u, r, p, rr)
+            {
+                double sum = 0.0;
+                for (int i = inf_i; i < sup_i; i++)
+                    for (int j = inf_j; j < sup_j; j++) {
+                        real_t res = u[i*ld+j-1] + u[i*ld+j+1] +
+                                     u[(i-1)*ld+j] + u[(i+1)*ld+j] - 4 * u[i*ld+j];
+                        r[i*ld+j] = p[i*ld+j] = res;
+                        sum += (double) res * res;
+                    }
+                rr[b] = sum;
+            }
+        }
+    }
+
+    #pragma omp task depend(iterator(k=0:nb), in: rr[k]) depend(out: rho[0]) \
+                     firstprivate(rr, rho)
+    {
+        double sum = 0.0;
+        for (int k = 0; k < nb; k++)
+            sum += rr[k];
+        *rho = sum;
+    }
+}
+
+/*
+ * Creates the tasks of one CG iteration on param->u, starting CG the first
+ * time. The residual added to *residual, or returned after waiting for the
+ * iteration with residual NULL, is r.r / 16 of the new residual: the sum of
+ * the squared updates that a Jacobi sweep would make, so that the tolerance
+ * means the same as for the other solvers.
+ */
+double relax_cg( algoparam_t *param, double *residual )
+{
+    double sum = 0.0;
+    double *res = residual ? residual : &sum;
+    int np = param->resolution + 2;
+    int nbx = param->nbx, nby = param->nby;
+    int nb = nbx * nby;
+
+    if( !param->cg )
+    {
+	cg_t *s = (cg_t *) calloc(1, sizeof(cg_t));
+	if( s )
+	{
+	    s->r = grid_alloc(np, np);
+	    s->p = grid_alloc(np, np);
+	    s->q = grid_alloc(np, np);
+	    s->pq = (double *) calloc(nb, sizeof(double));
+	    s->rr = (double *) calloc(nb, sizeof(double));
+	    s->np = np;
+	    param->cg = s;
+	}
+	if( !s || !s->r || !s->p || !s->q || !s->pq || !s->rr )
+	{
+	    fprintf(stderr, "Error: Cannot allocate the CG vectors\n");
+	    exit(1);
+	}
+	cg_start(s, param->u, np, nbx, nby);
+    }
+
+    cg_t *cg = (cg_t *)param->cg;
+    real_t *u = param->u, *r = cg->r, *p = cg->p, *q = cg->q;
+    double *pq = cg->pq, *rr = cg->rr;
+    double *rho = &cg->rho, *alpha = &cg->alpha, *beta = &cg->beta;
+    int bx = block_size(np - 2, nbx);
+    int by = block_size(np - 2, nby);
+    int ld = GRID_PITCH(np);
+
+    // q = A p, and p.q
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = 1 + ii * bx;
+            int sup_i = ((inf_i + bx) < np - 1) ? inf_i + bx : np - 1;
+            int inf_j = 1 + jj * by;
+            int sup_j = ((inf_j + by) < np - 1) ? inf_j + by : np - 1;
+            int b = ii * nby + jj;
+            #pragma omp task depend(in: p[inf_i*ld+inf_j],      \
+                                        p[(inf_i-bx)*ld+inf_j], \
+                                        p[sup_i*ld+inf_j],      \
+                                        p[inf_i*ld+inf_j-by],   \
+                                        p[inf_i*ld+sup_j])      \
+                             depend(out: q[inf_i*ld+inf_j], pq[b]) \
+                             firstprivate(p, q, pq)
+            {
+                double sum = 0.0;
+                for (int i = inf_i; i < sup_i; i++)
+                    for (int j = inf_j; j < sup_j; j++) {
+                        q[i*ld+j] = 4 * p[i*ld+j] - (p[i*ld+j-1] + p[i*ld+j+1] +
+                                                     p[(i-1)*ld+j] + p[(i+1)*ld+j]);
+                        sum += (double) p[i*ld+j] * q[i*ld+j];
+                    }
+                pq[b] = sum;
+            }
+        }
+    }
+
+    #pragma omp task depend(iterator(k=0:nb), in: pq[k]) depend(in: rho[0]) \
+                     depend(out: alpha[0]) firstprivate(pq, rho, alpha)
+    {
+        double sum = 0.0;
+        for (int k = 0; k < nb; k++)
+            sum += pq[k];
+        *alpha = (sum > 0.0) ? *rho / sum : 0.0;
+    }
+
+    // u += alpha p, r -= alpha q, and r.r
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = 1 + ii * bx;
+            int sup_i = ((inf_i + bx) < np - 1) ? inf_i + bx : np - 1;
+            int inf_j = 1 + jj * by;
+            int sup_j = ((inf_j + by) < np - 1) ? inf_j + by : np - 1;
+            int b = ii * nby + jj;
+            #pragma omp task depend(in: alpha[0], p[inf_i*ld+inf_j], q[inf_i*ld+inf_j]) \
+                             depend(inout: u[inf_i*ld+inf_j], r[inf_i*ld+inf_j]) \
+                             depend(out: rr[b]) firstprivate(u, r, p, q, rr, alpha)
+            {
+                real_t a = *alpha;
+                double sum = 0.0;
+                for (int i = inf_i; i < sup_i; i++)
+                    for (int j = inf_j; j < sup_j; j++) {
+                        u[i*ld+j] += a * p[i*ld+j];
+                        r[i*ld+j] -= a * q[i*ld+j];
+                        sum += (double) r[i*ld+j] * r[i*ld+j];
+                    }
+                rr[b] = sum;
+            }
+        }
+    }
+
+    #pragma omp task depend(iterator(k=0:nb), in: rr[k]) depend(inout: rho[0]) \
+                     depend(out: beta[0]) firstprivate(rr, rho, beta, res)
+    {
+        double sum = 0.0;
+        for (int k = 0; k < nb; k++)
+            sum += rr[k];
+        *beta = (*rho > 0.0) ? sum / *rho : 0.0;
+        *rho = sum;
+        #pragma omp atomic
+        *res += sum / 16;
+    }
+
+    // p = r + beta p
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = 1 + ii * bx;
+            int sup_i = ((inf_i + bx) < np - 1) ? inf_i + bx : np - 1;
+            int inf_j = 1 + jj * by;
+            int sup_j = ((inf_j + by) < np - 1) ? inf_j + by : np - 1;
+            #pragma omp task depend(in: beta[0], r[inf_i*ld+inf_j]) \
+                             depend(inout: p[inf_i*ld+inf_j]) firstprivate(r, p, beta)
+            {
+                real_t bt = *beta;
+                for (int i = inf_i; i < sup_i; i++)
+                    for (int j = inf_j; j < sup_j; j++)
+                        p[i*ld+j] = r[i*ld+j] + bt * p[i*ld+j];
+            }
+        }
+    }
+
+    // without a residual slot the caller wants the finished iteration
+    if( !residual )
+    {
+	#pragma omp taskwait
+    }
+    return sum;
+}
+
+void cg_free( void *p )
+{
+    cg_t *cg = (cg_t *)p;
+    int np = cg->np;
+
+    if( cg->r ) grid_free(cg->r, np, np);
+    if( cg->p ) grid_free(cg->p, np, np);
+    if( cg->q ) grid_free(cg->q, np, np);
+    free(cg->pq);
+    free(cg->rr);
+    free(cg);
+}
@@ -14,15 +14,32 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
 #include <omp.h>
+
+// default number of blocks per dimension, overridden with -b
 #if !defined(NB)
-#error All versions must define the number of blocks (NB)
+#define NB 8
 #endif
 
+// decompositions found by --tune, and the sweeps timed for each candidate
+#define TUNE_FILE   "heat.tune"
+#define TUNE_SWEEPS 8
+#define TUNE_MAX_NB 64
+
 #ifdef EXTRAE
 #include <extrae.h>
 #endif
 
+// the affinity clause is OpenMP 5.0
+#if _OPENMP >= 201811
+#define AFFINITY(x) affinity(x)
+#else
+#define AFFINITY(x)
+#endif
+
 
 #ifndef _OPENMP
     int omp_get_max_threads() { return 1; }
@@ -30,51 +47,1013 @@
 
 void usage( char *s )
 {
-    fprintf(stderr, "Usage: %s <input file> [result file]\n\n", s);
+    fprintf(stderr, "Usage: %s [-r resolution] [-b blocks[xblocks]] [-n repetitions] [-t depth] [-p window] [-v visres]\n"
+	    "       [-P processes] [--multigrid V|W] [--checkpoint file [--checkpoint-every sweeps]] [--restart file]\n"
+	    "       [--snapshot prefix [--snapshot-every sweeps] [--snapshot-raw]]\n"
+	    "       [--variant depend|taskgraph|seq|for|taskloop|taskwait] [--grainsize blocks] [--validate]\n"
+	    "       [--wavefront] [--idle]\n"
+	    "       [--tune] [--tune-file file] <input file> [result file]\n\n", s);
+}
+
+/*
+ * Block kernels. They return the sum of the squared updates of the block.
+ * The row pitch ld is a run-time argument so that any resolution works;
+ * SPECIALIZE() calls them with the constant pitch of the common
+ * power-of-two grids, so the inlined copies index with constant strides,
+ * and adds the returned residual to sum.
+ */
+#define SPECIALIZE(sum, sizey, kernel, ...)                                 \
+    switch (sizey) {                                                        \
+    case  512+2: sum += kernel(GRID_PITCH( 512+2), __VA_ARGS__); break;     \
+    case 1024+2: sum += kernel(GRID_PITCH(1024+2), __VA_ARGS__); break;     \
+    case 2048+2: sum += kernel(GRID_PITCH(2048+2), __VA_ARGS__); break;     \
+    case 4096+2: sum += kernel(GRID_PITCH(4096+2), __VA_ARGS__); break;     \
+    case 8192+2: sum += kernel(GRID_PITCH(8192+2), __VA_ARGS__); break;     \
+    case 16384+2: sum += kernel(GRID_PITCH(16384+2), __VA_ARGS__); break;   \
+    default: sum += kernel(GRID_PITCH(sizey), __VA_ARGS__); break;          \
+    }
+
+static inline double gauss_block(const int ld, real_t *u,
+                               int inf_i, int sup_i, int inf_j, int sup_j)
+{
+#if HEAT_VL > 1
+    return gauss_block_simd(ld, u, inf_i, sup_i, inf_j, sup_j);
+#else
+    accum_t sum = 0.0;
+    for (int i = inf_i; i < sup_i; ++i) {
+        for (int j = inf_j; j < sup_j; ++j) {
+            real_t unew = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                           u[(i-1)*ld+j] + u[(i+1)*ld+j]);
+            real_t diff = unew - u[i*ld+j];
+            sum += (accum_t) diff * diff;
+            u[i*ld+j] = unew;
+        }
+    }
+    return sum;
+#endif
+}
+
+static inline double jacobi_block(const int ld, real_t *u, real_t *utmp,
+                                int inf_i, int sup_i, int inf_j, int sup_j)
+{
+#if HEAT_VL > 1
+    return jacobi_block_simd(ld, u, utmp, inf_i, sup_i, inf_j, sup_j);
+#else
+    accum_t sum = 0.0;
+    for (int i = inf_i; i < sup_i; ++i) {
+        for (int j = inf_j; j < sup_j; ++j) {
+            utmp[i*ld+j] = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                            u[(i-1)*ld+j] + u[(i+1)*ld+j]);
+            real_t diff = utmp[i*ld+j] - u[i*ld+j];
+            sum += (accum_t) diff * diff;
+        }
+    }
+    return sum;
+#endif
+}
+
+static inline double redblack_block(const int ld, real_t *u, int color,
+                                  int inf_i, int sup_i, int inf_j, int sup_j)
+{
+#if HEAT_VL > 1
+    return redblack_block_simd(ld, u, color, inf_i, sup_i, inf_j, sup_j);
+#else
+    accum_t sum = 0.0;
+    for (int i = inf_i; i < sup_i; ++i) {
+        for (int j = inf_j + ((i + inf_j + color) & 1); j < sup_j; j += 2) {
+            real_t unew = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                           u[(i-1)*ld+j] + u[(i+1)*ld+j]);
+            real_t diff = unew - u[i*ld+j];
+            sum += (accum_t) diff * diff;
+            u[i*ld+j] = unew;
+        }
+    }
+    return sum;
+#endif
+}
+
+/*
+ * Time spent in Gauss-Seidel block tasks by every thread, HEAT_CL doubles
+ * apart, while heat measures idle time (--idle); NULL otherwise.
+ */
+static double *task_busy;
+
+#define BUSY_START() double busy0 = task_busy ? omp_get_wtime() : 0.0
+#define BUSY_STOP()                                                         \
+    if (task_busy)                                                          \
+        task_busy[omp_get_thread_num() * HEAT_CL] += omp_get_wtime() - busy0
+
+// blocks on anti-diagonal d of nbx x nby, and block k of them by rows
+static inline int wave_size(int nbx, int nby, int d)
+{
+    int lo = (d - nby + 1 > 0) ? d - nby + 1 : 0;
+    int hi = (d < nbx - 1) ? d : nbx - 1;
+    return hi - lo + 1;
+}
+
+static inline void wave_block(int nbx, int nby, int d, int k, int *ii, int *jj)
+{
+    *ii = ((d - nby + 1 > 0) ? d - nby + 1 : 0) + k;
+    *jj = d - *ii;
 }
 
-double (*u)[4098];
+/*
+ * Task of the Gauss-Seidel block (ii,jj) of bx x by points, with priority
+ * prio, shared by the two orders of the sweep below.
+ */
+static inline void gauss_task(real_t *u, unsigned sizex, unsigned sizey, int ld, int bx, int by,
+                              int ii, int jj, int prio, double *res)
+{
+  int inf_i = 1 + ii * bx;
+  int sup_i = ((inf_i + bx) < sizex - 1) ? inf_i + bx : sizex - 1;
+  int inf_j = 1 + jj * by;
+  int sup_j = ((inf_j + by) < sizey - 1) ? inf_j + by : sizey - 1;
+  #pragma omp task depend(in: u[(inf_i-bx)*ld+inf_j], \
+                              u[sup_i*ld+inf_j],      \
+                              u[inf_i*ld+inf_j-by],   \
+                              u[inf_i*ld+sup_j])      \
+                  depend(inout: u[inf_i*ld+inf_j]) firstprivate(sizex, sizey, u, res) \
+                  priority(prio) AFFINITY(u[inf_i*ld+inf_j])
+  {
+      BUSY_START();
+      double part = 0.0;
+      SPECIALIZE(part, sizey, gauss_block, u, inf_i, sup_i, inf_j, sup_j);
+      #pragma omp atomic
+      *res += part;
+      BUSY_STOP();
+  }
+}
 
-double relax_gauss(double *u1)
+/*
+ * The Gauss Seidel Heat function. The grid is sizex x sizey including the
+ * boundary, stored with the row pitch GRID_PITCH(sizey), and its interior
+ * is split into nbx x nby blocks of block_size() points, counted as
+ * block_count() does; the last block in each dimension is the one left
+ * short, with the points that remain.
+ *
+ * Every block task adds the squared updates of its points to *residual.
+ * With residual NULL the solver waits for its tasks and returns the residual
+ * of the sweep; otherwise it returns as soon as the tasks are created, so
+ * that consecutive sweeps overlap through the block dependences.
+ */
+double relax_gauss(real_t *u, unsigned sizex, unsigned sizey, unsigned nbx, unsigned nby,
+                   double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bx = block_size(sizex - 2, nbx);
+  int by = block_size(sizey - 2, nby);
+  int ld = GRID_PITCH(sizey);
+
+  for (int ii=0; ii<nbx; ii++)
+      for (int jj=0; jj<nby; jj++)
+          gauss_task(u, sizex, sizey, ld, bx, by, ii, jj, 0, res);
+
+  // without a residual slot the caller wants the finished sweep
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+/*
+ * relax_gauss() with the blocks created by anti-diagonals ii+jj, the order
+ * in which the wavefront can run them, so that the producer never stops
+ * at a block that has to wait while the next diagonal could start. Every
+ * block gets the number of anti-diagonals after its own as priority, the
+ * length of the critical path that it still holds up, so that a thread
+ * that can choose runs the block closest to the front of the wavefront.
+ * Priorities only count with OMP_MAX_TASK_PRIORITY set, up to nbx+nby-2.
+ */
+double relax_gauss_wavefront(real_t *u, unsigned sizex, unsigned sizey, unsigned nbx, unsigned nby,
+                             double *residual)
 {
   double sum = 0.0;
+  double *res = residual ? residual : &sum;
 
-  int sizex = NP;
-  int sizey = NP;
+  int bx = block_size(sizex - 2, nbx);
+  int by = block_size(sizey - 2, nby);
+  int ld = GRID_PITCH(sizey);
+  int nd = nbx + nby - 1;
 
-  u = (double (*)[sizey])u1;
-  int nbx = NB;
-  
-  int nby = NB;
-    int count = 0;
-  for (int ii=0; ii<NB; ii++) {
-      for (int jj=0; jj<NB; jj++) {
+  for (int d=0; d<nd; d++) {
+      for (int k=0; k<wave_size(nbx, nby, d); k++) {
+          int ii, jj;
+          wave_block(nbx, nby, d, k, &ii, &jj);
+          gauss_task(u, sizex, sizey, ld, bx, by, ii, jj, nd - 1 - d, res);
+      }
+  }
+  // without a residual slot the caller wants the finished sweep
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+/*
+ * Starts (start nonzero) or stops measuring the time threads spend in
+ * Gauss-Seidel block tasks. Stopping returns the total and frees the
+ * counters.
+ */
+double task_busy_time( int start )
+{
+    int nthreads = omp_get_max_threads();
+    double total = 0.0;
+
+    if( start )
+    {
+        task_busy = (double *) calloc((size_t)nthreads * HEAT_CL, sizeof(double));
+        return 0.0;
+    }
+    if( task_busy )
+    {
+        for( int t=0; t<nthreads; t++ )
+            total += task_busy[t * HEAT_CL];
+        free(task_busy);
+        task_busy = NULL;
+    }
+    return total;
+}
+
+/*
+ * Block of a time-skewed Gauss-Seidel tile: sweep s of the tile relaxes the
+ * block shifted up and left by s points, clipped to the interior. Returns
+ * the residual of the last sweep.
+ */
+static inline double gauss_skewed_block(const int ld, real_t *u, int sizex, int sizey, int nsweeps,
+                                        int inf_i, int sup_i, int inf_j, int sup_j)
+{
+    double sum = 0.0;
+    for (int s = 0; s < nsweeps; ++s) {
+        int lo_i = (inf_i - s > 1) ? inf_i - s : 1;
+        int hi_i = (sup_i - s < sizex - 1) ? sup_i - s : sizex - 1;
+        int lo_j = (inf_j - s > 1) ? inf_j - s : 1;
+        int hi_j = (sup_j - s < sizey - 1) ? sup_j - s : sizey - 1;
+        sum = gauss_block(ld, u, lo_i, hi_i, lo_j, hi_j);
+    }
+    return sum;
+}
+
+/*
+ * Temporally blocked Gauss Seidel: nsweeps sweeps are done by tasks that
+ * each keep one block in cache for a chunk of up to depth sweeps. Tiles are
+ * skewed by one point per sweep in both dimensions, which turns every data
+ * dependence of the sweep order into a non-negative tile offset, so the
+ * result is bit-identical to nsweeps calls of relax_gauss. A tile depends
+ * on its top and left neighbours of the same chunk and on the tiles at
+ * (0,0), (0,1), (1,0) and (1,1) of the previous chunk; depth must not
+ * exceed the block size. Unlike the other solvers it always waits for its
+ * tasks, and the residual is the one of the last sweep.
+ */
+double relax_gauss_tiled(real_t *u, unsigned sizex, unsigned sizey, unsigned nbx, unsigned nby,
+                         unsigned nsweeps, unsigned depth, double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bx = block_size(sizex - 2, nbx);
+  int by = block_size(sizey - 2, nby);
+
+  // skewing shifts the last tiles by up to depth-1 points
+  int ni = (sizex - 2 + depth - 1 + bx - 1) / bx;
+  int nj = (sizey - 2 + depth - 1 + by - 1) / by;
+
+  // one dependence token per tile, with a ring of unused ones around them
+  int tld = nj + 2;
+  char *tile = (char *) calloc((ni + 2) * tld, sizeof(char));
+  assert(tile != NULL);
+
+  for (int t = 0; t < nsweeps; t += depth) {
+      int steps = (t + depth < nsweeps) ? depth : nsweeps - t;
+      int last = (t + steps == nsweeps);
+      for (int ii=1; ii<=ni; ii++) {
+          for (int jj=1; jj<=nj; jj++) {
+              int inf_i = 1 + (ii-1) * bx;
+              int inf_j = 1 + (jj-1) * by;
+              #pragma omp task depend(in: tile[(ii-1)*tld+jj],   \
+                                          tile[ii*tld+jj-1],     \
+                                          tile[(ii+1)*tld+jj],   \
+                                          tile[ii*tld+jj+1],     \
+                                          tile[(ii+1)*tld+jj+1]) \
+                              depend(inout: tile[ii*tld+jj]) firstprivate(sizex, sizey, u, res) \
+                              AFFINITY(u[inf_i*GRID_PITCH(sizey)+inf_j])
+              {
+                  double part = 0.0;
+                  SPECIALIZE(part, sizey, gauss_skewed_block, u, sizex, sizey, steps,
+                             inf_i, inf_i + bx, inf_j, inf_j + by);
+                  if (last) {
+                      #pragma omp atomic
+                      *res += part;
+                  }
+              }
+          }
+      }
+  }
+  // the tokens are only valid while the tiles run
+  #pragma omp taskwait
+  free(tile);
+  return sum;
+}
+
+/* The Jacobi Heat function: reads u and writes the new values into utmp */
+double relax_jacobi(real_t *u, real_t *utmp, unsigned sizex, unsigned sizey, unsigned nbx, unsigned nby,
+                    double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bx = block_size(sizex - 2, nbx);
+  int by = block_size(sizey - 2, nby);
+  int ld = GRID_PITCH(sizey);
+
+  for (int ii=0; ii<nbx; ii++) {
+      for (int jj=0; jj<nby; jj++) {
           int inf_i = 1 + ii * bx;
           int sup_i = ((inf_i + bx) < sizex - 1) ? inf_i + bx : sizex - 1;
           int inf_j = 1 + jj * by;
           int sup_j = ((inf_j + by) < sizey - 1) ? inf_j + by : sizey - 1;
-          int min_i = inf_i -bx <0? 0:inf_i-bx;
-          int min_j = inf_j -bx <0? 0:inf_i-bx;
-          #pragma omp task depend(in: u[inf_i-bx][inf_j], \
-                                      u[sup_i][inf_j],    \
-                                      u[inf_i][inf_j-by], \
-                                      u[inf_i][sup_j])    \
-                          depend(inout: u[inf_i][inf_j]) firstprivate(sizex, sizey, u)
-	 	 {
-              for (int i = inf_i; i < sup_i; ++i) {
-                  for (int j = inf_j; j < sup_j; ++j) {
-                      double unew;
-                      unew = 0.25 * (u[i][j-1] + u[i][j+1] + u[i-1][j] + u[i+1][j]);
-                      u[i][j]=unew;
-                      //if(unew!=0) printf("Es %d %d \n", i, j);
-                  }
-              }
+          #pragma omp task depend(in: u[inf_i*ld+inf_j],      \
+                                      u[(inf_i-bx)*ld+inf_j], \
+                                      u[sup_i*ld+inf_j],      \
+                                      u[inf_i*ld+inf_j-by],   \
+                                      u[inf_i*ld+sup_j])      \
+                          depend(out: utmp[inf_i*ld+inf_j]) firstprivate(sizex, sizey, u, utmp, res) \
+                          AFFINITY(u[inf_i*ld+inf_j])
+          {
+              double part = 0.0;
+              SPECIALIZE(part, sizey, jacobi_block, u, utmp, inf_i, sup_i, inf_j, sup_j);
+              #pragma omp atomic
+              *res += part;
+          }
+      }
+  }
+  // without a residual slot the caller wants the finished sweep
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+/*
+ * The Red-Black Heat function: red points ((i+j) even) only read black
+ * neighbours and vice versa, so every block of a colour is independent.
+ * u[inf_i][inf_j] stands for the red half of a block and u[inf_i][inf_j+1]
+ * for the black half in the depend clauses. relax_redblack_color() does
+ * the half sweep of one colour.
+ */
+double relax_redblack_color(real_t *u, unsigned sizex, unsigned sizey, unsigned nbx, unsigned nby,
+                            int color, double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bx = block_size(sizex - 2, nbx);
+  int by = block_size(sizey - 2, nby);
+  int ld = GRID_PITCH(sizey);
+
+  for (int ii=0; ii<nbx; ii++) {
+      for (int jj=0; jj<nby; jj++) {
+          int inf_i = 1 + ii * bx;
+          int sup_i = ((inf_i + bx) < sizex - 1) ? inf_i + bx : sizex - 1;
+          int inf_j = 1 + jj * by;
+          int sup_j = ((inf_j + by) < sizey - 1) ? inf_j + by : sizey - 1;
+          int mine = color;       // offset of the colour being written
+          int other = 1 - color;  // offset of the colour being read
+          #pragma omp task depend(in: u[inf_i*ld+inf_j+other],      \
+                                      u[(inf_i-bx)*ld+inf_j+other], \
+                                      u[sup_i*ld+inf_j+other],      \
+                                      u[inf_i*ld+inf_j-by+other],   \
+                                      u[inf_i*ld+sup_j+other])      \
+                          depend(inout: u[inf_i*ld+inf_j+mine]) firstprivate(sizex, sizey, u, res) \
+                          AFFINITY(u[inf_i*ld+inf_j])
+          {
+              double part = 0.0;
+              SPECIALIZE(part, sizey, redblack_block, u, color, inf_i, sup_i, inf_j, sup_j);
+              #pragma omp atomic
+              *res += part;
           }
       }
   }
+  // without a residual slot the caller wants the finished half sweep
+  if (!residual) {
+      #pragma omp taskwait
+  }
   return sum;
 }
 
+double relax_redblack(real_t *u, unsigned sizex, unsigned sizey, unsigned nbx, unsigned nby,
+                      double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  for (int color=0; color<2; color++)
+      relax_redblack_color(u, sizex, sizey, nbx, nby, color, res);
+
+  // without a residual slot the caller wants the finished sweep
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+/*
+ * Sweeps of the other programming models (--variant), to compare their
+ * scheduling overhead with the depend tasks above. They split a sweep in
+ * phases of independent blocks and synchronize every phase: Gauss-Seidel
+ * has one phase per anti-diagonal ii+jj of the wavefront, Red-Black one
+ * per colour and Jacobi a single one. All of them give the results of the
+ * depend tasks bit for bit.
+ */
+static inline int phase_count(int alg, int nbx, int nby)
+{
+    return (alg == 1) ? nbx + nby - 1 : (alg == 2) ? 2 : 1;
+}
+
+static inline int phase_size(int alg, int nbx, int nby, int d)
+{
+    return (alg == 1) ? wave_size(nbx, nby, d) : nbx * nby;
+}
+
+// block k of phase d, row-major within a phase
+static inline void phase_block(int alg, int nbx, int nby, int d, int k, int *ii, int *jj)
+{
+    if (alg == 1)
+        wave_block(nbx, nby, d, k, ii, jj);
+    else {
+        *ii = k / nby;
+        *jj = k % nby;
+    }
+}
+
+static double phase_block_relax(int alg, real_t *u, real_t *utmp, unsigned np,
+                                int nbx, int nby, int d, int k)
+{
+    int ii, jj;
+    phase_block(alg, nbx, nby, d, k, &ii, &jj);
+
+    int bx = block_size(np - 2, nbx);
+    int by = block_size(np - 2, nby);
+    int inf_i = 1 + ii * bx;
+    int sup_i = ((inf_i + bx) < np - 1) ? inf_i + bx : np - 1;
+    int inf_j = 1 + jj * by;
+    int sup_j = ((inf_j + by) < np - 1) ? inf_j + by : np - 1;
+
+    double part = 0.0;
+    switch (alg) {
+    case 0: SPECIALIZE(part, np, jacobi_block, u, utmp, inf_i, sup_i, inf_j, sup_j); break;
+    case 1: SPECIALIZE(part, np, gauss_block, u, inf_i, sup_i, inf_j, sup_j); break;
+    case 2: SPECIALIZE(part, np, redblack_block, u, d, inf_i, sup_i, inf_j, sup_j); break;
+    }
+    return part;
+}
+
+/*
+ * One sweep of param->variant, which always waits for its blocks. The
+ * parallel for variant makes its own team and must be called outside a
+ * parallel region; the task variants expect a single producer.
+ */
+double relax_phased( algoparam_t *param, unsigned np )
+{
+    int alg = param->algorithm, nbx = param->nbx, nby = param->nby;
+    int nphases = phase_count(alg, nbx, nby);
+    int grainsize = param->grainsize;
+    real_t *u = param->u, *utmp = param->uhelp;
+    double sum = 0.0;
+
+    switch( param->variant )
+    {
+    case VARIANT_SEQ:
+        for (int d = 0; d < nphases; d++)
+            for (int k = 0; k < phase_size(alg, nbx, nby, d); k++)
+                sum += phase_block_relax(alg, u, utmp, np, nbx, nby, d, k);
+        break;
+
+    case VARIANT_FOR:
+        #pragma omp parallel
+        for (int d = 0; d < nphases; d++) {
+            int n = phase_size(alg, nbx, nby, d);
+            #pragma omp for schedule(dynamic) reduction(+: sum)
+            for (int k = 0; k < n; k++)
+                sum += phase_block_relax(alg, u, utmp, np, nbx, nby, d, k);
+        }
+        break;
+
+    case VARIANT_TASKLOOP:
+        for (int d = 0; d < nphases; d++) {
+            int n = phase_size(alg, nbx, nby, d);
+            #pragma omp taskloop grainsize(grainsize) reduction(+: sum)
+            for (int k = 0; k < n; k++)
+                sum += phase_block_relax(alg, u, utmp, np, nbx, nby, d, k);
+        }
+        break;
+
+    case VARIANT_TASKWAIT:
+        for (int d = 0; d < nphases; d++) {
+            int n = phase_size(alg, nbx, nby, d);
+            for (int k = 0; k < n; k++) {
+                #pragma omp task firstprivate(d, k) shared(sum)
+                {
+                    double part = phase_block_relax(alg, u, utmp, np, nbx, nby, d, k);
+                    #pragma omp atomic
+                    sum += part;
+                }
+            }
+            #pragma omp taskwait
+        }
+        break;
+    }
+
+    if( alg == 0 )
+    {
+        param->u = utmp;
+        param->uhelp = u;
+    }
+    return sum;
+}
+
+/*
+ * Checkpoint being written: the copy task that brings pending to zero
+ * commits the file.
+ */
+typedef struct
+{
+    int pending;
+    real_t *grid;
+    const char *path;
+    unsigned np, sweeps;
+}
+ckpt_state_t;
+
+/*
+ * Starts an asynchronous checkpoint of param->u after sweeps sweeps: one
+ * task per block copies it into the mapped file as soon as the sweep has
+ * produced the block, and the next sweep only waits for the copy of the
+ * blocks it overwrites. Both colour tokens are read so that the same
+ * dependences work for the three solvers. The tiled Gauss-Seidel tracks
+ * its blocks with its own tokens, so there the copies are waited for.
+ * Only a persistent team (-p) overlaps the copies with the next sweeps;
+ * with a team per sweep its closing barrier waits for them, so there the
+ * checkpoint only overlaps the end of its own sweep.
+ */
+void checkpoint_step( algoparam_t *param, unsigned np, unsigned sweeps )
+{
+    real_t *u = param->u;
+    real_t *ck = checkpoint_open(param->checkpoint, np, sweeps);
+    if( !ck )
+        return;
+
+    int nbx = param->nbx, nby = param->nby;
+    int bx = block_size(np - 2, nbx);
+    int by = block_size(np - 2, nby);
+
+    ckpt_state_t *state = (ckpt_state_t *) malloc(sizeof(ckpt_state_t));
+    assert(state != NULL);
+    state->pending = nbx * nby;
+    state->grid = ck;
+    state->path = param->checkpoint;
+    state->np = np;
+    state->sweeps = sweeps;
+
+    // the boundary never changes
+    int ld = GRID_PITCH(np);
+    for( int j=0; j<np; j++ )
+    {
+        ck[j] = u[j];
+        ck[(np-1)*ld+j] = u[(np-1)*ld+j];
+        ck[j*ld] = u[j*ld];
+        ck[j*ld+(np-1)] = u[j*ld+(np-1)];
+    }
+
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = 1 + ii * bx;
+            int sup_i = ((inf_i + bx) < np - 1) ? inf_i + bx : np - 1;
+            int inf_j = 1 + jj * by;
+            int sup_j = ((inf_j + by) < np - 1) ? inf_j + by : np - 1;
+            #pragma omp task depend(in: u[inf_i*ld+inf_j], u[inf_i*ld+inf_j+1]) \
+                             firstprivate(u, ck, state)
+            {
+                for (int i = inf_i; i < sup_i; ++i)
+                    if (inf_j < sup_j)
+                        memcpy(&ck[i*ld+inf_j], &u[i*ld+inf_j], (sup_j-inf_j) * sizeof(real_t));
+
+                int left;
+                #pragma omp atomic capture
+                left = --state->pending;
+                if (left == 0) {
+                    checkpoint_commit(state->path, state->grid, state->np, state->sweeps);
+                    free(state);
+                }
+            }
+        }
+    }
+
+    if( param->algorithm == 1 && param->depth > 1 )
+    {
+        #pragma omp taskwait
+    }
+}
+
+/*
+ * Snapshots of the grid while it is solved, averaged down to the
+ * visualization resolution. Snapshots alternate between two buffers,
+ * param->uvis and a second one, so that writing a snapshot overlaps the
+ * sweeps and the coarsening of the next one. The first point of a buffer
+ * is its token: the write of a snapshot updates it and the coarsen tasks
+ * of the snapshot after next read it, so they never overwrite an image
+ * that has not been written yet.
+ */
+typedef struct
+{
+    real_t *vis[2];
+    char *done[2];          // one token per coarsen task, for the write
+    unsigned sweeps[2];     // sweeps of the snapshot in each buffer
+    int next;               // buffer of the next snapshot
+    int pending;            // buffer coarsened but not written yet, or -1
+    unsigned n;             // points per side of the snapshots
+    int nb;
+}
+snap_t;
+
+/*
+ * Writes snapshot vis of n x n points after sweeps sweeps to
+ * prefix.sweeps.ppm, or to prefix.sweeps.raw as a line
+ * "heat n n bytes-per-point sweeps" followed by the raw points.
+ */
+static void snapshot_file( const char *prefix, int raw, real_t *vis, unsigned n,
+                           unsigned sweeps )
+{
+    char path[strlen(prefix) + 16];
+    sprintf(path, "%s.%06u.%s", prefix, sweeps, raw ? "raw" : "ppm");
+
+    FILE *f = fopen(path, "w");
+    if( !f )
+    {
+        fprintf(stderr, "Warning: Cannot write snapshot \"%s\"\n", path);
+        return;
+    }
+    if( raw )
+    {
+        fprintf(f, "heat %u %u %zu %u\n", n, n, sizeof(real_t), sweeps);
+        fwrite(vis, sizeof(real_t), (size_t)n * n, f);
+    }
+    else
+        write_image(f, vis, n, n);
+    fclose(f);
+}
+
+// block row (column) of grid row (column) r, the boundary with the first or last
+#define SNAP_BLOCK(r, b, nb) \
+    (((r) < 1) ? 0 : (((r) - 1) / (b) < (nb) - 1) ? ((r) - 1) / (b) : (nb) - 1)
+
+/*
+ * Starts a snapshot of param->u after sweeps sweeps into the next buffer.
+ * The points of the snapshot are split among the blocks of the grid by
+ * the first row and column they average, and one task per block coarsens
+ * its points as soon as the sweep has produced the blocks they read, with
+ * both colour tokens as in checkpoint_step(). snapshot_write() then writes
+ * the buffer.
+ */
+void snapshot_step( algoparam_t *param, unsigned np, unsigned sweeps )
+{
+    int nbx = param->nbx, nby = param->nby;
+    unsigned n = (param->visres < param->resolution) ? param->visres + 2 : np;
+
+    if( !param->snap )
+    {
+        snap_t *s = (snap_t *) calloc(1, sizeof(snap_t));
+        if( s )
+        {
+            s->vis[0] = param->uvis;
+            s->vis[1] = (real_t *) calloc((size_t)n * n, sizeof(real_t));
+            s->done[0] = (char *) calloc(nbx * nby, 1);
+            s->done[1] = (char *) calloc(nbx * nby, 1);
+            s->pending = -1;
+            s->n = n;
+            s->nb = nbx * nby;
+            param->snap = s;
+        }
+        if( !s || !s->vis[1] || !s->done[0] || !s->done[1] )
+        {
+            fprintf(stderr, "Error: Cannot allocate the snapshot buffers\n");
+            exit(1);
+        }
+    }
+
+    snap_t *snap = (snap_t *)param->snap;
+    int b = snap->next;
+    real_t *u = param->u, *vis = snap->vis[b];
+    char *done = snap->done[b];
+    int bx = block_size(np - 2, nbx);
+    int by = block_size(np - 2, nby);
+    int ld = GRID_PITCH(np);
+
+    // first snapshot row (column) of every block row (column), and the
+    // last block row (column) that the points of each one read
+    int row[nbx + 1], col[nby + 1], lastrow[nbx], lastcol[nby];
+    for( int ii=0, i=0; ii<=nbx; ii++ )
+    {
+        while( i < n && SNAP_BLOCK((long)i * np / n, bx, nbx) < ii )
+            i++;
+        row[ii] = i;
+    }
+    for( int jj=0, j=0; jj<=nby; jj++ )
+    {
+        while( j < n && SNAP_BLOCK((long)j * np / n, by, nby) < jj )
+            j++;
+        col[jj] = j;
+    }
+    for( int ii=0; ii<nbx; ii++ )
+        lastrow[ii] = SNAP_BLOCK((long)row[ii+1] * np / n - 1, bx, nbx);
+    for( int jj=0; jj<nby; jj++ )
+        lastcol[jj] = SNAP_BLOCK((long)col[jj+1] * np / n - 1, by, nby);
+
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = row[ii], sup_i = row[ii+1];
+            int inf_j = col[jj], sup_j = col[jj+1];
+            int a1 = lastrow[ii] + 1, b1 = lastcol[jj] + 1;
+            if (inf_i == sup_i || inf_j == sup_j)
+                continue;
+            #pragma omp task depend(iterator(a=ii:a1, c=jj:b1, k=0:2), \
+                                    in: u[(1+a*bx)*ld+1+c*by+k])       \
+                             depend(in: vis[0]) depend(out: done[ii*nby+jj]) \
+                             firstprivate(u, vis, done)
+            coarsen_block(u, np, np, ld, vis, n, n, inf_i, sup_i, inf_j, sup_j);
+        }
+    }
+
+    snap->sweeps[b] = sweeps;
+    snap->pending = b;
+    snap->next = 1 - b;
+
+    if( param->algorithm == 1 && param->depth > 1 )
+    {
+        #pragma omp taskwait
+    }
+}
+
+/*
+ * Creates the task that writes the last snapshot started, once its
+ * coarsen tasks are done. It depends on nothing else, so it runs along
+ * the sweeps created after it.
+ */
+void snapshot_write( algoparam_t *param )
+{
+    snap_t *snap = (snap_t *)param->snap;
+    if( !snap || snap->pending < 0 )
+        return;
+
+    int b = snap->pending, nb = snap->nb;
+    real_t *vis = snap->vis[b];
+    char *done = snap->done[b];
+    unsigned n = snap->n, sweeps = snap->sweeps[b];
+    const char *prefix = param->snapshot;
+    int raw = param->snap_raw;
+
+    #pragma omp task depend(iterator(k=0:nb), in: done[k]) depend(inout: vis[0]) \
+                     firstprivate(vis, done, n, sweeps, prefix, raw)
+    snapshot_file(prefix, raw, vis, n, sweeps);
+
+    snap->pending = -1;
+}
+
+// the first buffer is param->uvis, freed by finalize()
+void snapshot_free( void *p )
+{
+    snap_t *snap = (snap_t *)p;
+
+    free(snap->vis[1]);
+    free(snap->done[0]);
+    free(snap->done[1]);
+    free(snap);
+}
+
+/*
+ * Creates the tasks of the next step sweeps (more than one only for the
+ * temporally blocked Gauss-Seidel) with the solver selected in param, or
+ * of a multigrid cycle, which stands for a sweep, with --multigrid. For
+ * Jacobi, param->u and param->uhelp are swapped so that param->u always
+ * names the grid the next sweep reads.
+ */
+double relax_step( algoparam_t *param, unsigned np, unsigned step, double *residual )
+{
+    double sum = 0.0;
+
+    if( param->cycle )
+        return relax_multigrid(param, residual);
+    if( param->variant >= VARIANT_SEQ )
+        return relax_phased(param, np);
+
+    switch( param->algorithm )
+    {
+    case 0:
+        sum = relax_jacobi(param->u, param->uhelp, np, np, param->nbx, param->nby, residual);
+        {
+            // the freshly computed grid becomes the input of the next sweep
+            real_t *tmp = param->u;
+            param->u = param->uhelp;
+            param->uhelp = tmp;
+        }
+        break;
+    case 1:
+        if( step > 1 )
+            sum = relax_gauss_tiled(param->u, np, np, param->nbx, param->nby, step, step, residual);
+        else if( param->wavefront )
+            sum = relax_gauss_wavefront(param->u, np, np, param->nbx, param->nby, residual);
+        else
+            sum = relax_gauss(param->u, np, np, param->nbx, param->nby, residual);
+        break;
+    case 2:
+        sum = relax_redblack(param->u, np, np, param->nbx, param->nby, residual);
+        break;
+    case 3:
+        sum = relax_cg(param, residual);
+        break;
+    }
+    return sum;
+}
+
+/*
+ * Sweeps of a multi-process run, see slab.c: runs up to total sweeps over
+ * the slab of this process and returns the sweeps done. A sweep is one
+ * phase, or two for the colours of Red-Black, and before every phase the
+ * ghost rows get the neighbours' rows that the single-process sweep would
+ * see: the previous phase of both neighbours, except for Gauss-Seidel,
+ * whose first row reads the current sweep of the slab above. The first row
+ * of a Gauss-Seidel slab is published as soon as its blocks are done, so
+ * that the slab above can start its next sweep. The residual is summed
+ * over the processes every window sweeps (every sweep without a window)
+ * when there is a tolerance, and after the last sweep.
+ */
+unsigned relax_slabs( algoparam_t *param, unsigned total, double *residual,
+                      int *converged )
+{
+    unsigned np = param->resolution + 2;
+    unsigned nx = param->rows + 2;
+    unsigned nbx = param->nbx, nby = param->nby;
+    unsigned phases = (param->algorithm == 2) ? 2 : 1;
+    unsigned every = param->window ? param->window : 1;
+    int ld = GRID_PITCH(np);
+    int by = block_size(np - 2, nby);
+    unsigned sweeps;
+
+    for( sweeps=0; sweeps < total; sweeps++ )
+    {
+        double sum = 0.0;
+
+        for( unsigned phase=0; phase < phases; phase++ )
+        {
+            unsigned seq = sweeps * phases + phase;
+
+            slab_halo(param, param->u, seq + (param->algorithm == 1), seq);
+
+            #pragma omp parallel
+            #pragma omp single
+            {
+                real_t *u = param->u;
+
+                switch( param->algorithm )
+                {
+                case 0:
+                    relax_jacobi(u, param->uhelp, nx, np, nbx, nby, &sum);
+                    break;
+                case 1:
+                    relax_gauss(u, nx, np, nbx, nby, &sum);
+                    #pragma omp task depend(in: u[1*ld+1+(nby-1)*by]) firstprivate(u)
+                    slab_publish(param, u, SLAB_FIRST, seq + 1);
+                    break;
+                case 2:
+                    relax_redblack_color(u, nx, np, nbx, nby, phase, &sum);
+                    break;
+                }
+            }
+
+            if( param->algorithm == 0 )
+            {
+                real_t *tmp = param->u;
+                param->u = param->uhelp;
+                param->uhelp = tmp;
+            }
+            slab_publish(param, param->u,
+                         (param->algorithm == 1) ? SLAB_LAST : SLAB_FIRST | SLAB_LAST,
+                         seq + 1);
+        }
+
+        if( sweeps + 1 == total ||
+            (param->tolerance > 0.0 && (sweeps + 1) % every == 0) )
+        {
+            *residual = slab_reduce(param, sum);
+            if( param->tolerance > 0.0 && *residual < param->tolerance )
+            {
+                *converged = 1;
+                return sweeps + 1;
+            }
+        }
+    }
+    return sweeps;
+}
+
+/*
+ * Time sweeps sweeps of param on freshly initialized grids, first-touched
+ * for its decomposition, after one warm-up step. Returns seconds per sweep.
+ */
+static double tune_probe( algoparam_t *param, unsigned sweeps )
+{
+    algoparam_t probe = *param;
+    probe.visres = 0;
+    probe.ckpt_every = 0;
+    probe.map = NULL;
+    probe.mg = NULL;
+    probe.cg = NULL;
+    if( !initialize(&probe) )
+        return -1.0;
+
+    unsigned np = probe.resolution + 2;
+    unsigned step = (probe.algorithm == 1 && probe.depth > 1) ? probe.depth : 1;
+    unsigned done = 0;
+    double residual = 0.0, t = 0.0;
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        relax_step(&probe, np, step, &residual);
+        #pragma omp taskwait
+
+        // a multigrid cycle depends on every block of the one before, so
+        // cycles in flight only add to the memory of their dependences
+        t = wtime();
+        for( done = 0; done < sweeps; done += step )
+        {
+            relax_step(&probe, np, step, &residual);
+            if( probe.cycle )
+            {
+                #pragma omp taskwait
+            }
+        }
+        #pragma omp taskwait
+        t = wtime() - t;
+    }
+
+    if( probe.mg )
+        mg_free(probe.mg);
+    if( probe.cg )
+        cg_free(probe.cg);
+    finalize(&probe);
+    return t / done;
+}
+
+/*
+ * Search the nbx x nby decompositions of param for the fastest: powers of
+ * two and small multiples of the number of threads up to TUNE_MAX_NB in
+ * each dimension, normalized with block_count() and deep enough for the
+ * temporal blocking. Sets param->nbx and param->nby and returns the time
+ * per sweep of the winner.
+ */
+double tune_blocks( algoparam_t *param, unsigned sweeps )
+{
+    unsigned cand[2 * TUNE_MAX_NB];
+    int ncand = 0;
+    int nthreads = omp_get_max_threads();
+    double best = -1.0;
+
+    for( unsigned nb = 1; nb <= TUNE_MAX_NB; nb++ )
+    {
+        int pow2 = (nb & (nb - 1)) == 0;
+        int mult = nb % nthreads == 0 && nb <= 4 * nthreads;
+        if( !(pow2 || mult) || nb > param->resolution ||
+            param->depth > param->resolution / nb )
+            continue;
+        unsigned n = block_count(param->resolution, nb);
+        if( ncand == 0 || cand[ncand-1] != n )
+            cand[ncand++] = n;
+    }
+
+    unsigned nbx = param->nbx, nby = param->nby;
+    for( int x = 0; x < ncand; x++ )
+        for( int y = 0; y < ncand; y++ )
+        {
+            param->nbx = cand[x];
+            param->nby = cand[y];
+            double t = tune_probe(param, sweeps);
+            if( t >= 0.0 && (best < 0.0 || t < best) )
+            {
+                best = t;
+                nbx = cand[x];
+                nby = cand[y];
+            }
+        }
+
+    param->nbx = nbx;
+    param->nby = nby;
+    return best;
+}
+
+// names of the VARIANT_* models for --variant
+static const char *variant_names[] = { "depend", "taskgraph", "seq", "for", "taskloop", "taskwait" };
+
 int main( int argc, char *argv[] )
 {
     FILE *infile, *resfile;
@@ -84,20 +1063,126 @@ int main( int argc, char *argv[] )
     int np;
 
     double runtime;
-    // double residual=0.0;
-    unsigned iter = 0;
+    double residual=0.0;
+    unsigned step = 1;
+    unsigned sweeps = 0, start = 0;
+    int converged = 0;
+
+    // command line overrides of the problem size and decomposition
+    unsigned resolution = 0;
+    unsigned nbx = NB, nby = NB;
+    int blocks = 0, tune = 0;
+    char *tunefile = TUNE_FILE;
+    unsigned numiter = NUM_ITER;
+    unsigned depth = 1;
+    unsigned window = 0;
+    int visres = -1;
+    char *checkpoint = NULL, *restart = NULL;
+    unsigned ckpt_every = 0;
+    char *snapshot = NULL;
+    unsigned snap_every = 0;
+    int snap_raw = 0;
+#ifdef TDG
+    int variant = VARIANT_TASKGRAPH;
+#else
+    int variant = VARIANT_DEPEND;
+#endif
+    unsigned grainsize = 1;
+    int validate = 0;
+    int wavefront = 0, idle = 0;
+    unsigned nprocs = 1;
+    unsigned cycle = 0;
+    int opt;
+
+    static struct option longopts[] = {
+	{ "checkpoint",       required_argument, NULL, 'c' },
+	{ "checkpoint-every", required_argument, NULL, 'k' },
+	{ "restart",          required_argument, NULL, 'R' },
+	{ "tune",             no_argument,       NULL, 'T' },
+	{ "tune-file",        required_argument, NULL, 'F' },
+	{ "procs",            required_argument, NULL, 'P' },
+	{ "multigrid",        required_argument, NULL, 'M' },
+	{ "snapshot",         required_argument, NULL, 'S' },
+	{ "snapshot-every",   required_argument, NULL, 'K' },
+	{ "snapshot-raw",     no_argument,       NULL, 'W' },
+	{ "variant",          required_argument, NULL, 'm' },
+	{ "grainsize",        required_argument, NULL, 'g' },
+	{ "validate",         no_argument,       NULL, 'C' },
+	{ "wavefront",        no_argument,       NULL, 'w' },
+	{ "idle",             no_argument,       NULL, 'I' },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    while( (opt = getopt_long(argc, argv, "r:b:n:t:p:v:c:k:R:P:", longopts, NULL)) != -1 )
+    {
+	switch( opt )
+	{
+	case 'c': checkpoint = optarg; break;
+	case 'k': ckpt_every = atoi(optarg); break;
+	case 'R': restart = optarg; break;
+	case 'T': tune = 1; break;
+	case 'F': tunefile = optarg; break;
+	case 'P': nprocs = atoi(optarg); break;
+	case 'S': snapshot = optarg; break;
+	case 'K': snap_every = atoi(optarg); break;
+	case 'W': snap_raw = 1; break;
+	case 'g': grainsize = atoi(optarg); break;
+	case 'C': validate = 1; break;
+	case 'w': wavefront = 1; break;
+	case 'I': idle = 1; break;
+	case 'm':
+	    for( variant = VARIANT_TASKWAIT; variant >= 0; variant-- )
+		if( !strcmp(optarg, variant_names[variant]) )
+		    break;
+	    if( variant < 0 )
+	    {
+		usage( argv[0] );
+		return 1;
+	    }
+	    break;
+	case 'M':
+	    // V or W cycles
+	    cycle = (optarg[0] == 'V' || optarg[0] == 'v') ? 1 :
+		    (optarg[0] == 'W' || optarg[0] == 'w') ? 2 : 0;
+	    if( !cycle || optarg[1] )
+	    {
+		usage( argv[0] );
+		return 1;
+	    }
+	    break;
+	case 'v': visres = atoi(optarg); break;
+	case 'p': window = atoi(optarg); break;
+	case 'r': resolution = atoi(optarg); break;
+	case 'b':
+	    // blocks along both dimensions, or rows x columns
+	    blocks = sscanf(optarg, "%ux%u", &nbx, &nby);
+	    if( blocks == 1 )
+		nby = nbx;
+	    else if( blocks != 2 )
+	    {
+		usage( argv[0] );
+		return 1;
+	    }
+	    break;
+	case 'n': numiter = atoi(optarg); break;
+	case 't': depth = atoi(optarg); break;
+	default:
+	    usage( argv[0] );
+	    return 1;
+	}
+    }
 
     // check arguments
-    if( argc < 2 )
+    if( optind >= argc )
     {
 	usage( argv[0] );
 	return 1;
     }
 
     // check input file
-    if( !(infile=fopen(argv[1], "r"))  )
+    if( !(infile=fopen(argv[optind], "r"))  )
     {
-	fprintf(stderr, "\nError: Cannot open \"%s\" for reading.\n\n", argv[1]);
+	fprintf(stderr, "\nError: Cannot open \"%s\" for reading.\n\n", argv[optind]);
 
 	usage(argv[0]);
 	return 1;
@@ -105,14 +1190,16 @@ int main( int argc, char *argv[] )
 
     // check result file
     unsigned size = strlen(argv[0]) + 4 + 1;
+    if( optind + 1 < argc )
+	size = strlen(argv[optind+1]) + 1;
     char resfilename[size]; 
     resfilename[0] = '\0';
-    // if (argc >= 3)
-    //     strcat(resfilename, argv[2]);
-    // else {
+    if( optind + 1 < argc )
+	strcat(resfilename, argv[optind+1]);
+    else {
     strcat(resfilename, argv[0]);
     strcat(resfilename, ".ppm");
-    // }
+    }
 
     if( !(resfile=fopen(resfilename, "w")) )
     {
@@ -129,12 +1216,158 @@ int main( int argc, char *argv[] )
 	return 1;
     }
 
+    if( resolution )
+	param.resolution = param.visres = resolution;
+    if( visres >= 0 )
+	param.visres = visres;
+    param.nbx = nbx;
+    param.nby = nby;
+    param.numiter = numiter;
+    param.depth = depth;
+    param.window = window;
+    param.checkpoint = checkpoint;
+    param.ckpt_every = checkpoint ? ckpt_every : 0;
+    param.map = NULL;
+    param.cycle = cycle;
+    param.mg = NULL;
+    param.cg = NULL;
+    // a snapshot after every maxiter sweeps unless told otherwise
+    param.snapshot = snapshot;
+    param.snap_every = !snapshot ? 0 : snap_every ? snap_every : param.maxiter;
+    param.snap_raw = snap_raw;
+    param.snap = NULL;
+    param.variant = variant;
+    param.grainsize = grainsize;
+    param.wavefront = wavefront;
+
+    // a restart takes the grid, its resolution and the sweeps already
+    // done from the checkpoint instead of computing the initial state
+    if( restart )
+    {
+	if( !checkpoint_restore(restart, &param, &start) )
+	{
+	    fprintf(stderr, "\nError: Cannot restart from \"%s\".\n\n", restart);
+	    usage(argv[0]);
+	    return 1;
+	}
+    }
+
+    // without -b, the decomposition tuned for this host, resolution and threads
+    if( !blocks && !tune )
+	tune_lookup(tunefile, &param, omp_get_max_threads());
+
+    if( param.nbx < 1 || param.nbx > param.resolution ||
+	param.nby < 1 || param.nby > param.resolution )
+    {
+	fprintf(stderr, "\nError: The number of blocks must be between 1 and the resolution.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+    if( param.depth < 1 || param.depth > param.resolution / param.nbx ||
+	param.depth > param.resolution / param.nby )
+    {
+	fprintf(stderr, "\nError: The temporal blocking depth must be between 1 and the block size.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+    // a multi-process run sweeps slabs with the single-sweep solvers, and
+    // multigrid smooths with Gauss-Seidel or Red-Black only
+    if( cycle && (nprocs > 1 || param.depth > 1 || param.algorithm == 0 || param.algorithm == 3) )
+    {
+	fprintf(stderr, "\nError: Multigrid does not work with -P, temporal blocking, Jacobi or CG.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+    if( nprocs < 1 || (nprocs > 1 && (restart || checkpoint || snapshot || tune ||
+				      param.depth > 1 || param.algorithm == 3)) )
+    {
+	fprintf(stderr, "\nError: -P needs at least 1 process, and more than one does not work with\n"
+		"checkpoints, snapshots, --tune, temporal blocking or CG.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+    // a checkpoint holds u alone, not the Krylov state of CG
+    if( param.algorithm == 3 && (restart || checkpoint) )
+    {
+	fprintf(stderr, "\nError: Checkpoints and --restart do not work with CG.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+#ifndef TDG
+    if( variant == VARIANT_TASKGRAPH )
+    {
+	fprintf(stderr, "\nError: The taskgraph variant needs a build with -DTDG.\n\n");
+	return 1;
+    }
+#endif
+    // the other models only do plain sweeps, waiting for every one
+    if( variant >= VARIANT_SEQ && (param.algorithm > 2 || cycle || param.depth > 1 ||
+				   param.window || nprocs > 1 || checkpoint || snapshot || tune) )
+    {
+	fprintf(stderr, "\nError: The %s variant does not work with CG, multigrid, -t, -p, -P,\n"
+		"checkpoints, snapshots or --tune.\n\n", variant_names[variant]);
+	usage(argv[0]);
+	return 1;
+    }
+    if( validate && (param.algorithm > 2 || cycle || nprocs > 1) )
+    {
+	fprintf(stderr, "\nError: --validate only works with Jacobi, Gauss-Seidel and Red-Black\n"
+		"in a single process.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+    // only the block tasks of relax_gauss() and relax_gauss_wavefront()
+    if( (wavefront || idle) && (param.algorithm != 1 || cycle || param.depth > 1 ||
+				nprocs > 1 || variant >= VARIANT_SEQ) )
+    {
+	fprintf(stderr, "\nError: --wavefront and --idle only work with the Gauss-Seidel block tasks,\n"
+		"without multigrid, -t, -P or the other variants.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+    if( grainsize < 1 )
+    {
+	fprintf(stderr, "\nError: The grainsize must be at least 1 block.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+    if( snapshot && !param.visres )
+    {
+	fprintf(stderr, "\nError: Snapshots need a visualization resolution (-v) above 0.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+
+    // from here on every process runs its own slab of rows
+    if( !slab_start(&param, nprocs) )
+    {
+	fprintf(stderr, "\nError: Cannot start %u processes.\n\n", nprocs);
+	return 1;
+    }
+
+    param.nbx = block_count(param.rows, param.nbx);
+    param.nby = block_count(param.resolution, param.nby);
+
     //print_params(&param);
 
-    assert((param.algorithm == 1)
-            && "Only Gauss-seidel is currently implemented\n");
+    assert((param.algorithm >= 0) && (param.algorithm <= 3)
+            && "Algorithm must be 0 (Jacobi), 1 (Gauss-Seidel), 2 (Red-Black) or 3 (CG)\n");
 
-    if( !initialize(&param) )
+    // probe the decompositions on scratch grids and keep the fastest
+    if( tune )
+    {
+	double t = tune_blocks(&param, TUNE_SWEEPS);
+	fprintf(stdout, "tuned blocks %ux%u %e s/sweep\n", param.nbx, param.nby, t);
+	tune_record(tunefile, &param, omp_get_max_threads(), t);
+    }
+
+    if( !restart && !initialize(&param) )
 	{
 	    fprintf(stderr, "Error in Solver initialization.\n\n");
 	    usage(argv[0]);
@@ -142,31 +1375,143 @@ int main( int argc, char *argv[] )
 	}
 
     // full size (param.resolution are only the inner points)
-    // np = param.resolution + 2;
-    np = RESOLUTION + 2;
+    np = param.resolution + 2;
 
     #ifdef EXTRAE
     Extrae_init();
     #endif
+    // the processes start the clock together
+    if( param.nprocs > 1 )
+	slab_reduce(&param, 0.0);
+
+    // the initial grids, to repeat the sweeps sequentially at the end
+    algoparam_t ref = param;
+    if( validate )
+    {
+	ref.u = grid_alloc(np, np);
+	ref.uhelp = grid_alloc(np, np);
+	if( !ref.u || !ref.uhelp )
+	{
+	    fprintf(stderr, "Error: Cannot allocate the grids to validate\n");
+	    return 1;
+	}
+	memcpy(ref.u - (HEAT_CL - 1), param.u - (HEAT_CL - 1), GRID_SPAN(np, np) * sizeof(real_t));
+	memcpy(ref.uhelp - (HEAT_CL - 1), param.uhelp - (HEAT_CL - 1), GRID_SPAN(np, np) * sizeof(real_t));
+	ref.variant = VARIANT_SEQ;
+    }
+
+    if( idle )
+	task_busy_time(1);
+
     // starting time
      runtime = wtime();
 
 //#ifdef _OPENMP
-    for (int i=0; i<NUM_ITER; i++)
-    {
+    // the maxiter sweeps are repeated numiter times without resetting the grid
+    unsigned total = param.numiter * param.maxiter;
 
-     for(iter=0; iter < param.maxiter; ++iter)
+    if( param.nprocs > 1 )
+    {
+        sweeps = relax_slabs(&param, total, &residual, &converged);
+    }
+    else if( !param.window )
+    {
+        for( sweeps=start; sweeps < total; sweeps += step )
         {
+            // sweeps done by this step, more than one only when temporally blocked
+            step = 1;
+            if( param.algorithm == 1 && param.depth > 1 )
+                step = (total - sweeps < param.depth) ? total - sweeps : param.depth;
+
+            // worksharing needs the whole team, so it makes its own
+            if( param.variant == VARIANT_FOR )
+                residual = relax_step(&param, np, step, NULL);
+            else
             #pragma omp parallel
             #pragma omp single
+            {
+                // the snapshot of the previous team is written during this sweep
+                if( param.snap_every )
+                    snapshot_write(&param);
+
+                // the tasks of multigrid and CG are created in mg.c and
+                // cg.c, outside the statically recorded graph of heat.c
+                if( param.variant != VARIANT_TASKGRAPH || param.cycle || param.algorithm == 3 )
+                    residual = relax_step(&param, np, step, NULL);
+                else
+                {
                 #ifdef TDG
                 #pragma omp taskgraph tdg_type(static)
-            #endif
+                #endif
+                {
+                    residual = relax_step(&param, np, step, NULL);
+                }
+                }
+
+                // outside the taskgraph, which must be the same every sweep
+                if( param.ckpt_every && (sweeps + step) / param.ckpt_every > sweeps / param.ckpt_every )
+                    checkpoint_step(&param, np, sweeps + step);
+                if( param.snap_every && (sweeps + step) / param.snap_every > sweeps / param.snap_every )
+                    snapshot_step(&param, np, sweeps + step);
+            }
+
+            if( param.tolerance > 0.0 && residual < param.tolerance )
             {
-                relax_gauss(param.u);
+                converged = 1;
+                sweeps += step;
+                break;
             }
         }
-      //memcpy (u_tmp, param.u, sizeof(double) * np * np);
+
+        // the last snapshot has no sweep left to overlap
+        if( param.snap_every )
+            snapshot_write(&param);
+    }
+    else
+    {
+    // a single team runs all the sweeps; the tasks of consecutive sweeps
+    // only meet at the block dependences, and the producer waits for them
+    // every param.window sweeps to test the convergence
+    unsigned next_check = start + param.window;
+    double *sweep_res = (double *) calloc( total + 1, sizeof(double) );
+    assert(sweep_res != NULL);
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        for( sweeps=start; sweeps < total; sweeps += step )
+        {
+            step = 1;
+            if( param.algorithm == 1 && param.depth > 1 )
+                step = (total - sweeps < param.depth) ? total - sweeps : param.depth;
+
+            relax_step(&param, np, step, &sweep_res[sweeps+step-1]);
+
+            if( param.ckpt_every && (sweeps + step) / param.ckpt_every > sweeps / param.ckpt_every )
+                checkpoint_step(&param, np, sweeps + step);
+
+            // written while the next sweeps run, as far as the buffers allow
+            if( param.snap_every && (sweeps + step) / param.snap_every > sweeps / param.snap_every )
+            {
+                snapshot_step(&param, np, sweeps + step);
+                snapshot_write(&param);
+            }
+
+            if( param.tolerance > 0.0 && sweeps + step >= next_check )
+            {
+                #pragma omp taskwait
+                next_check += param.window;
+                if( sweep_res[sweeps+step-1] < param.tolerance )
+                {
+                    converged = 1;
+                    sweeps += step;
+                    break;
+                }
+            }
+        }
+    }
+    residual = (sweeps > start) ? sweep_res[sweeps-1] : 0.0;
+    free(sweep_res);
     }
 
     // stopping time
@@ -176,10 +1521,73 @@ int main( int argc, char *argv[] )
     Extrae_fini();
     #endif
 
-    //fprintf(stdout, "test, %s, output_file, %s, time, %f, threads, %d, NB, %d\n", argv[0], resfilename, runtime, omp_get_max_threads(), NB);
+    // the other processes only hand their slab over for the image
+    if( param.rank > 0 )
+    {
+	if( param.visres )
+	    slab_gather(&param, param.u);
+	fclose(resfile);
+	finalize( &param );
+	return slab_finish( &param ) ? 0 : 1;
+    }
+
+    //fprintf(stdout, "test, %s, output_file, %s, time, %f, threads, %d, NB, %dx%d\n", argv[0], resfilename, runtime, omp_get_max_threads(), param.nbx, param.nby);
     fprintf(stdout,"time %f\n", runtime);
+    if( param.nprocs > 1 )
+	fprintf(stdout,"processes %u\n", param.nprocs);
+    fprintf(stdout,"sweeps %u residual %e%s\n", sweeps, residual,
+	    converged ? " (converged)" : "");
+    fprintf(stdout,"variant %s%s\n", variant_names[param.variant],
+	    param.wavefront ? " wavefront" : "");
 
-    
+    // thread time not spent in block tasks, including the task creation
+    if( idle )
+    {
+	int nthreads = omp_get_max_threads();
+	double busy = task_busy_time(0);
+	double avail = nthreads * runtime;
+	fprintf(stdout,"idle %f s of %d threads x %f s (%.1f%%)\n", avail - busy,
+		nthreads, runtime, 100.0 * (avail - busy) / avail);
+    }
+
+    // the same sweeps in block order on one thread must give the same grid
+    if( validate )
+    {
+	double diff = 0.0;
+	int ld = GRID_PITCH(np);
+
+	for( unsigned s=start; s<sweeps; s++ )
+	    relax_phased(&ref, np);
+	for( int i=1; i<np-1; i++ )
+	    for( int j=1; j<np-1; j++ )
+	    {
+		double d = fabs((double)param.u[i*ld+j] - ref.u[i*ld+j]);
+		if( d > diff )
+		    diff = d;
+	    }
+	fprintf(stdout,"validate max difference %e against seq%s\n", diff,
+		(diff == 0.0) ? "" : " (DIFFERENT)");
+	grid_free(ref.u, np, np);
+	grid_free(ref.uhelp, np, np);
+    }
+
+    // average the grid down to the visualization resolution (-v 0 skips it)
+    if( param.visres )
+    {
+	unsigned vis = (param.visres < param.resolution) ? param.visres + 2 : np;
+	real_t *u = (param.nprocs > 1) ? slab_gather(&param, param.u) : param.u;
+	coarsen(u, np, np, GRID_PITCH(np), param.uvis, vis, vis);
+	write_image(resfile, param.uvis, vis, vis);
+    }
+    fclose(resfile);
+
+    // state of the solvers and snapshots; misc.c, shared with heat3d, leaves it
+    if( param.mg )
+	mg_free(param.mg);
+    if( param.cg )
+	cg_free(param.cg);
+    if( param.snap )
+	snapshot_free(param.snap);
     finalize( &param );
-    return 0;
+    return slab_finish( &param ) ? 0 : 1;
 }
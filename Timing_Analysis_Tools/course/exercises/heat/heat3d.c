@@ -0,0 +1,455 @@
+//
+// This file is part of Heat Gauss Seidel  and is licensed under the terms contained in the COPYING file.
+// Copyright (C) 2015-2020 Barcelona Supercomputing Center (BSC)
+//
+
+/*
+ * Iterative solver for heat distribution in a cube, the 3D variant of
+ * heat.c. The input file is the same, with the heat sources given as
+ * x y z range temperature (a source without z sits on the z=0 face); the
+ * sources heat the six faces.
+ *
+ * The grid has resolution+2 points per side and is stored as planes of
+ * rows: point (k,i,j) is u[k*lp + i*ld + j] with the row pitch
+ * ld = GRID_PITCH(np) of heat.h and the plane pitch lp = np*ld, so
+ * grid_alloc(np*np, np) allocates it. The interior is split into
+ * nbx x nby x nbz blocks, one task each, that depend on their six face
+ * neighbours.
+ *
+ * Every block kernel walks its block plane by plane, so a block only keeps
+ * three planes of its rows in cache. With nbz 1 (-b XxYx1) the tasks are
+ * 2.5D: each one streams a whole column of X x Y tiles along z. A larger
+ * nbz blocks z so that a task stays in the cache as a whole.
+ */
+#include "heat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <omp.h>
+
+// default number of blocks per dimension, overridden with -b
+#if !defined(NB)
+#define NB 4
+#endif
+
+#ifdef EXTRAE
+#include <extrae.h>
+#endif
+
+void usage( char *s )
+{
+    fprintf(stderr, "Usage: %s [-r resolution] [-b blocks[xblocks[xblocks]]] [-n repetitions] [-v visres]\n"
+	    "       <input file> [result file]\n\n", s);
+}
+
+static inline double gauss_block3d(const int ld, const size_t lp, real_t *u,
+                                   int inf_k, int sup_k, int inf_i, int sup_i,
+                                   int inf_j, int sup_j)
+{
+    accum_t sum = 0.0;
+    for (int k = inf_k; k < sup_k; ++k) {
+        for (int i = inf_i; i < sup_i; ++i) {
+            real_t *c = &u[k*lp + i*ld];
+            for (int j = inf_j; j < sup_j; ++j) {
+                real_t unew = (real_t) (1.0 / 6) * (c[j-1] + c[j+1] + c[j-ld] + c[j+ld] +
+                                                    c[j-lp] + c[j+lp]);
+                real_t diff = unew - c[j];
+                sum += (accum_t) diff * diff;
+                c[j] = unew;
+            }
+        }
+    }
+    return sum;
+}
+
+static inline double jacobi_block3d(const int ld, const size_t lp, real_t *u, real_t *utmp,
+                                    int inf_k, int sup_k, int inf_i, int sup_i,
+                                    int inf_j, int sup_j)
+{
+    accum_t sum = 0.0;
+    for (int k = inf_k; k < sup_k; ++k) {
+        for (int i = inf_i; i < sup_i; ++i) {
+            real_t *c = &u[k*lp + i*ld];
+            real_t *t = &utmp[k*lp + i*ld];
+            for (int j = inf_j; j < sup_j; ++j) {
+                t[j] = (real_t) (1.0 / 6) * (c[j-1] + c[j+1] + c[j-ld] + c[j+ld] +
+                                             c[j-lp] + c[j+lp]);
+                real_t diff = t[j] - c[j];
+                sum += (accum_t) diff * diff;
+            }
+        }
+    }
+    return sum;
+}
+
+static inline double redblack_block3d(const int ld, const size_t lp, real_t *u, int color,
+                                      int inf_k, int sup_k, int inf_i, int sup_i,
+                                      int inf_j, int sup_j)
+{
+    accum_t sum = 0.0;
+    for (int k = inf_k; k < sup_k; ++k) {
+        for (int i = inf_i; i < sup_i; ++i) {
+            real_t *c = &u[k*lp + i*ld];
+            for (int j = inf_j + ((k + i + inf_j + color) & 1); j < sup_j; j += 2) {
+                real_t unew = (real_t) (1.0 / 6) * (c[j-1] + c[j+1] + c[j-ld] + c[j+ld] +
+                                                    c[j-lp] + c[j+lp]);
+                real_t diff = unew - c[j];
+                sum += (accum_t) diff * diff;
+                c[j] = unew;
+            }
+        }
+    }
+    return sum;
+}
+
+/*
+ * Bounds of block (kk,ii,jj) of the n^3 interior points of a grid with np
+ * points per side, as in the 2D solvers.
+ */
+#define BLOCK3D(n, bz, bx, by)                                               \
+    int inf_k = 1 + kk * (bz);                                               \
+    int sup_k = ((inf_k + (bz)) < (n) + 1) ? inf_k + (bz) : (n) + 1;         \
+    int inf_i = 1 + ii * (bx);                                               \
+    int sup_i = ((inf_i + (bx)) < (n) + 1) ? inf_i + (bx) : (n) + 1;         \
+    int inf_j = 1 + jj * (by);                                               \
+    int sup_j = ((inf_j + (by)) < (n) + 1) ? inf_j + (by) : (n) + 1;         \
+    size_t tok = inf_k*lp + inf_i*ld + inf_j
+
+/*
+ * The solvers follow their 2D versions in heat.c: u[tok] is the token of a
+ * block, at its first point, and u[tok+1] the black half for Red-Black.
+ * With residual NULL they wait for the sweep and return its residual,
+ * otherwise they add it to *residual and return without waiting.
+ */
+double relax_gauss3d(real_t *u, unsigned n, unsigned nbx, unsigned nby, unsigned nbz,
+                     double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bz = block_size(n, nbz);
+  int bx = block_size(n, nbx);
+  int by = block_size(n, nby);
+  int ld = GRID_PITCH(n + 2);
+  size_t lp = (size_t)(n + 2) * ld;
+
+  for (int kk=0; kk<nbz; kk++) {
+      for (int ii=0; ii<nbx; ii++) {
+          for (int jj=0; jj<nby; jj++) {
+              BLOCK3D(n, bz, bx, by);
+              #pragma omp task depend(in: u[tok-bz*lp], u[tok+(sup_k-inf_k)*lp], \
+                                          u[tok-bx*ld], u[tok+(sup_i-inf_i)*ld], \
+                                          u[tok-by],    u[tok+(sup_j-inf_j)])    \
+                              depend(inout: u[tok]) firstprivate(u, res)
+              {
+                  double part = gauss_block3d(ld, lp, u, inf_k, sup_k, inf_i, sup_i, inf_j, sup_j);
+                  #pragma omp atomic
+                  *res += part;
+              }
+          }
+      }
+  }
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+double relax_jacobi3d(real_t *u, real_t *utmp, unsigned n, unsigned nbx, unsigned nby,
+                      unsigned nbz, double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bz = block_size(n, nbz);
+  int bx = block_size(n, nbx);
+  int by = block_size(n, nby);
+  int ld = GRID_PITCH(n + 2);
+  size_t lp = (size_t)(n + 2) * ld;
+
+  for (int kk=0; kk<nbz; kk++) {
+      for (int ii=0; ii<nbx; ii++) {
+          for (int jj=0; jj<nby; jj++) {
+              BLOCK3D(n, bz, bx, by);
+              #pragma omp task depend(in: u[tok],                                 \
+                                          u[tok-bz*lp], u[tok+(sup_k-inf_k)*lp], \
+                                          u[tok-bx*ld], u[tok+(sup_i-inf_i)*ld], \
+                                          u[tok-by],    u[tok+(sup_j-inf_j)])    \
+                              depend(out: utmp[tok]) firstprivate(u, utmp, res)
+              {
+                  double part = jacobi_block3d(ld, lp, u, utmp, inf_k, sup_k, inf_i, sup_i, inf_j, sup_j);
+                  #pragma omp atomic
+                  *res += part;
+              }
+          }
+      }
+  }
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+double relax_redblack3d(real_t *u, unsigned n, unsigned nbx, unsigned nby, unsigned nbz,
+                        double *residual)
+{
+  double sum = 0.0;
+  double *res = residual ? residual : &sum;
+
+  int bz = block_size(n, nbz);
+  int bx = block_size(n, nbx);
+  int by = block_size(n, nby);
+  int ld = GRID_PITCH(n + 2);
+  size_t lp = (size_t)(n + 2) * ld;
+
+  for (int color=0; color<2; color++) {
+      int mine = color, other = 1 - color;
+      for (int kk=0; kk<nbz; kk++) {
+          for (int ii=0; ii<nbx; ii++) {
+              for (int jj=0; jj<nby; jj++) {
+                  BLOCK3D(n, bz, bx, by);
+                  #pragma omp task depend(in: u[tok+other],                                 \
+                                              u[tok-bz*lp+other], u[tok+(sup_k-inf_k)*lp+other], \
+                                              u[tok-bx*ld+other], u[tok+(sup_i-inf_i)*ld+other], \
+                                              u[tok-by+other],    u[tok+(sup_j-inf_j)+other])    \
+                                  depend(inout: u[tok+mine]) firstprivate(u, res, color)
+                  {
+                      double part = redblack_block3d(ld, lp, u, color, inf_k, sup_k,
+                                                     inf_i, sup_i, inf_j, sup_j);
+                      #pragma omp atomic
+                      *res += part;
+                  }
+              }
+          }
+      }
+  }
+  if (!residual) {
+      #pragma omp taskwait
+  }
+  return sum;
+}
+
+/*
+ * Allocate the grids, first-touched plane by plane, and heat the faces:
+ * every boundary point gets (range-dist)/range*temp from each source
+ * closer than range, with x along j, y along i and z along k.
+ */
+static int initialize3d( algoparam_t *param )
+{
+    const int np = param->resolution + 2;
+    const int ld = GRID_PITCH(np);
+    const size_t lp = (size_t)np * ld;
+
+    param->u     = grid_alloc( np * np, np );
+    param->uhelp = grid_alloc( np * np, np );
+    param->uvis  = (real_t*)calloc( sizeof(real_t),
+				    (param->visres+2) *
+				    (param->visres+2) );
+    if( !(param->u) || !(param->uhelp) || !(param->uvis) )
+    {
+	fprintf(stderr, "Error: Cannot allocate memory\n");
+	return 0;
+    }
+
+    #pragma omp parallel for schedule(static)
+    for( int k=0; k<np; k++ )
+    {
+	memset(&param->u[k*lp], 0, lp * sizeof(real_t));
+	memset(&param->uhelp[k*lp], 0, lp * sizeof(real_t));
+    }
+
+    for( int s=0; s<param->numsrcs; s++ )
+    {
+	heatsrc_t *src = &param->heatsrcs[s];
+
+	for( int k=0; k<np; k++ )
+	    for( int i=0; i<np; i++ )
+		for( int j=0; j<np; j++ )
+		{
+		    // the faces only, each point once
+		    if( k != 0 && k != np-1 && i != 0 && i != np-1 && j == 1 )
+			j = np-1;
+		    double dist = sqrt( pow((double)j/(np-1) - src->posx, 2) +
+					pow((double)i/(np-1) - src->posy, 2) +
+					pow((double)k/(np-1) - src->posz, 2) );
+		    if( dist <= src->range )
+			param->u[k*lp + i*ld + j] +=
+			    (src->range-dist) / src->range * src->temp;
+		}
+    }
+
+    // the faces of uhelp, the interiors are both zero
+    memcpy(param->uhelp, param->u, np * lp * sizeof(real_t));
+    return 1;
+}
+
+int main( int argc, char *argv[] )
+{
+    FILE *infile, *resfile;
+    algoparam_t param;
+    double runtime, residual = 0.0;
+    unsigned sweeps = 0;
+    int converged = 0;
+
+    unsigned resolution = 0;
+    unsigned nbx = NB, nby = NB, nbz = NB;
+    unsigned numiter = NUM_ITER;
+    int visres = -1;
+    int opt;
+
+    while( (opt = getopt(argc, argv, "r:b:n:v:")) != -1 )
+    {
+	switch( opt )
+	{
+	case 'r': resolution = atoi(optarg); break;
+	case 'n': numiter = atoi(optarg); break;
+	case 'v': visres = atoi(optarg); break;
+	case 'b':
+	    // blocks along the three dimensions, or x x y x z
+	    switch( sscanf(optarg, "%ux%ux%u", &nbx, &nby, &nbz) )
+	    {
+	    case 1: nby = nbz = nbx; break;
+	    case 2: nbz = 1; break;
+	    case 3: break;
+	    default:
+		usage( argv[0] );
+		return 1;
+	    }
+	    break;
+	default:
+	    usage( argv[0] );
+	    return 1;
+	}
+    }
+
+    if( optind >= argc )
+    {
+	usage( argv[0] );
+	return 1;
+    }
+
+    if( !(infile=fopen(argv[optind], "r"))  )
+    {
+	fprintf(stderr, "\nError: Cannot open \"%s\" for reading.\n\n", argv[optind]);
+	usage(argv[0]);
+	return 1;
+    }
+
+    char *resfilename = (optind + 1 < argc) ? argv[optind+1] : "heat3d.ppm";
+    if( !(resfile=fopen(resfilename, "w")) )
+    {
+	fprintf(stderr, "\nError: Cannot open \"%s\" for writing.\n\n", resfilename);
+	usage(argv[0]);
+	return 1;
+    }
+
+    if( !read_input(infile, &param) )
+    {
+	fprintf(stderr, "\nError: Error parsing input file.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+    fclose(infile);
+
+    if( resolution )
+	param.resolution = param.visres = resolution;
+    if( visres >= 0 )
+	param.visres = visres;
+    param.numiter = numiter;
+
+    if( nbx < 1 || nbx > param.resolution || nby < 1 || nby > param.resolution ||
+	nbz < 1 || nbz > param.resolution )
+    {
+	fprintf(stderr, "\nError: The number of blocks must be between 1 and the resolution.\n\n");
+	usage(argv[0]);
+	return 1;
+    }
+    if( param.algorithm < 0 || param.algorithm > 2 )
+    {
+	fprintf(stderr, "\nError: heat3d has algorithms 0 (Jacobi), 1 (Gauss-Seidel) and 2 (Red-Black).\n\n");
+	return 1;
+    }
+
+    unsigned n = param.resolution;
+    unsigned np = n + 2;
+    nbx = block_count(n, nbx);
+    nby = block_count(n, nby);
+    nbz = block_count(n, nbz);
+
+    if( !initialize3d(&param) )
+	return 1;
+
+    #ifdef EXTRAE
+    Extrae_init();
+    #endif
+    runtime = wtime();
+
+    unsigned total = param.numiter * param.maxiter;
+    for( sweeps=0; sweeps < total; sweeps++ )
+    {
+	#pragma omp parallel
+	#pragma omp single
+	{
+	    #ifdef TDG
+	    #pragma omp taskgraph tdg_type(static)
+	    #endif
+	    {
+		switch( param.algorithm )
+		{
+		case 0:
+		    residual = relax_jacobi3d(param.u, param.uhelp, n, nbx, nby, nbz, NULL);
+		    break;
+		case 1:
+		    residual = relax_gauss3d(param.u, n, nbx, nby, nbz, NULL);
+		    break;
+		case 2:
+		    residual = relax_redblack3d(param.u, n, nbx, nby, nbz, NULL);
+		    break;
+		}
+	    }
+	}
+
+	if( param.algorithm == 0 )
+	{
+	    real_t *tmp = param.u;
+	    param.u = param.uhelp;
+	    param.uhelp = tmp;
+	}
+
+	if( param.tolerance > 0.0 && residual < param.tolerance )
+	{
+	    converged = 1;
+	    sweeps++;
+	    break;
+	}
+    }
+
+    runtime = wtime() - runtime;
+    #ifdef EXTRAE
+    Extrae_fini();
+    #endif
+
+    fprintf(stdout, "time %f\n", runtime);
+    fprintf(stdout, "sweeps %u residual %e%s\n", sweeps, residual,
+	    converged ? " (converged)" : "");
+    fprintf(stdout, "blocks %ux%ux%u\n", nbx, nby, nbz);
+
+    // the middle z plane, averaged down to the visualization resolution
+    if( param.visres )
+    {
+	unsigned vis = (param.visres < n) ? param.visres + 2 : np;
+	size_t lp = (size_t)np * GRID_PITCH(np);
+	coarsen(&param.u[(np/2)*lp], np, np, GRID_PITCH(np), param.uvis, vis, vis);
+	write_image(resfile, param.uvis, vis, vis);
+    }
+    fclose(resfile);
+
+    grid_free(param.u, np * np, np);
+    grid_free(param.uhelp, np * np, np);
+    free(param.uvis);
+    free(param.heatsrcs);
+    return 0;
+}
@@ -0,0 +1,435 @@
+//
+// This file is part of Heat Gauss Seidel  and is licensed under the terms contained in the COPYING file.
+// Copyright (C) 2015-2020 Barcelona Supercomputing Center (BSC)
+//
+
+/*
+ * Geometric multigrid for the steady state of the heat problem. Level 0 is
+ * the grid of param->u, smoothed with the block solvers of heat.c
+ * (Gauss-Seidel for algorithm 1, Red-Black for 2; heat.c rejects the
+ * others), and every coarser level has about half the points per side,
+ * down to MG_COARSEST. A coarse level solves for the correction of the
+ * level above, 4u - sum(neighbours) = g with a zero boundary, where g is
+ * the restricted residual scaled by the squared spacing, with Red-Black
+ * sweeps that take g into account.
+ *
+ * The levels are not aligned (4096 interior points halve into 2048, whose
+ * points fall between the fine ones), so the transfers work in grid
+ * coordinates like coarsen() does: the restriction is the full weighting
+ * of the residual with hat functions as wide as two fine spacings, and the
+ * prolongation the bilinear interpolation of the correction.
+ *
+ * Every step of a cycle is a set of block tasks. Blocks use the tokens of
+ * heat.c, u[inf_i][inf_j] for red and u[inf_i][inf_j+1] for black, plus
+ * g[inf_i][inf_j] for the right-hand side, and a transfer depends on every
+ * block of the other level it reads through a depend iterator, so the
+ * levels overlap as far as their data allows and a whole cycle is created
+ * without waiting.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "heat.h"
+
+#ifdef EXTRAE
+#include <extrae.h>
+// tasks of level l > 0 run inside an event of this type with value l
+#define MG_EXTRAE_LEVEL 7000
+#define MG_EVENT(v) Extrae_event(MG_EXTRAE_LEVEL, (v))
+#else
+#define MG_EVENT(v) ((void) (v))
+#endif
+
+#define MG_PRE      2       // smoothing sweeps before the coarse correction
+#define MG_POST     2       // and after it
+#define MG_COARSEST 4       // interior points per side of the coarsest level
+#define MG_SOLVE    40      // Red-Black sweeps that solve the coarsest level
+#define MG_LEVELS   32
+#define MG_TAPS     4       // fine points under a restriction hat
+
+typedef struct
+{
+    unsigned n;             // interior points per side
+    unsigned nbx, nby;
+    real_t *u, *g;          // solution or correction, scaled right-hand side
+    // restriction into this level: fine points taps[I][0..count[I]) from
+    // first[I] with weights w[I][] feed coarse point I
+    int *first, *count;
+    double (*w)[MG_TAPS];
+    // prolongation out of this level: fine point i interpolates between
+    // coarse points cell[i] and cell[i]+1 with weight frac[i] on the second
+    int *cell;
+    double *frac;
+    double scale;           // (coarse spacing / fine spacing)^2
+}
+mg_level_t;
+
+typedef struct
+{
+    int nlevels;
+    int gamma;              // coarse visits per level, 1=>V, 2=>W
+    int algorithm;
+    double discard;         // residual slot of the sweeps not reported
+    mg_level_t level[MG_LEVELS];
+}
+mg_t;
+
+/*
+ * Red-Black sweep of one colour with right-hand side: 4u - sum = g.
+ */
+static inline double mg_smooth_block(const int ld, real_t *u, const real_t *g, int color,
+                                     int inf_i, int sup_i, int inf_j, int sup_j)
+{
+    double sum = 0.0;
+    for (int i = inf_i; i < sup_i; ++i) {
+        for (int j = inf_j + ((i + inf_j + color) & 1); j < sup_j; j += 2) {
+            real_t unew = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                           u[(i-1)*ld+j] + u[(i+1)*ld+j] + g[i*ld+j]);
+            real_t diff = unew - u[i*ld+j];
+            sum += (double) diff * diff;
+            u[i*ld+j] = unew;
+        }
+    }
+    return sum;
+}
+
+static void mg_smooth_color(mg_level_t *lv, int l, int color, double *res)
+{
+    real_t *u = lv->u, *g = lv->g;
+    int n = lv->n, nbx = lv->nbx, nby = lv->nby;
+    int bx = block_size(n, nbx);
+    int by = block_size(n, nby);
+    int ld = GRID_PITCH(n + 2);
+
+    for (int ii=0; ii<nbx; ii++) {
+        for (int jj=0; jj<nby; jj++) {
+            int inf_i = 1 + ii * bx;
+            int sup_i = ((inf_i + bx) < n + 1) ? inf_i + bx : n + 1;
+            int inf_j = 1 + jj * by;
+            int sup_j = ((inf_j + by) < n + 1) ? inf_j + by : n + 1;
+            int mine = color;
+            int other = 1 - color;
+            #pragma omp task depend(in: u[inf_i*ld+inf_j+other],      \
+                                        u[(inf_i-bx)*ld+inf_j+other], \
+                                        u[sup_i*ld+inf_j+other],      \
+                                        u[inf_i*ld+inf_j-by+other],   \
+                                        u[inf_i*ld+sup_j+other],      \
+                                        g[inf_i*ld+inf_j])            \
+                             depend(inout: u[inf_i*ld+inf_j+mine]) firstprivate(u, g, res)
+            {
+                MG_EVENT(l);
+                double part = mg_smooth_block(ld, u, g, color, inf_i, sup_i, inf_j, sup_j);
+                #pragma omp atomic
+                *res += part;
+                MG_EVENT(0);
+            }
+        }
+    }
+}
+
+/*
+ * Solve the coarsest level l with MG_SOLVE Red-Black sweeps in a single
+ * task: it is a handful of points, and a W-cycle visits it 2^l times.
+ */
+static void mg_solve(mg_t *mg, int l)
+{
+    mg_level_t *lv = &mg->level[l];
+    real_t *u = lv->u, *g = lv->g;
+    int n = lv->n, nbx = lv->nbx, nby = lv->nby;
+    int bx = block_size(n, nbx);
+    int by = block_size(n, nby);
+    int ld = GRID_PITCH(n + 2);
+
+    #pragma omp task depend(iterator(a=0:nbx, b=0:nby),             \
+                            inout: u[(1+a*bx)*ld+1+b*by],           \
+                                   u[(1+a*bx)*ld+1+b*by+1])         \
+                     depend(iterator(a=0:nbx, b=0:nby),             \
+                            in: g[(1+a*bx)*ld+1+b*by])              \
+                     firstprivate(u, g)
+    {
+        MG_EVENT(l);
+        for (int s = 0; s < MG_SOLVE; s++)
+            for (int color = 0; color < 2; color++)
+                mg_smooth_block(ld, u, g, color, 1, n + 1, 1, n + 1);
+        MG_EVENT(0);
+    }
+}
+
+// one smoothing sweep of level l
+static void mg_smooth(mg_t *mg, int l, double *res)
+{
+    mg_level_t *lv = &mg->level[l];
+
+    if (l > 0) {
+        mg_smooth_color(lv, l, 0, res);
+        mg_smooth_color(lv, l, 1, res);
+    } else if (mg->algorithm == 1)
+        relax_gauss(lv->u, lv->n + 2, lv->n + 2, lv->nbx, lv->nby, res);
+    else
+        relax_redblack(lv->u, lv->n + 2, lv->n + 2, lv->nbx, lv->nby, res);
+}
+
+/*
+ * Restrict the residual of level l-1 into the right-hand side of level l
+ * and clear the correction of level l. Every coarse block sums the residual
+ * of the fine rows under its hats row by row, weighting the columns, and
+ * then combines the rows.
+ */
+static void mg_restrict(mg_t *mg, int l)
+{
+    mg_level_t *fl = &mg->level[l-1], *cl = &mg->level[l];
+    real_t *uf = fl->u, *gf = fl->g, *uc = cl->u, *gc = cl->g;
+    // the finest level has no right-hand side; its tokens stand in
+    real_t *gtok = gf ? gf : uf;
+    int nf = fl->n, nc = cl->n;
+    int bxf = block_size(nf, fl->nbx), byf = block_size(nf, fl->nby);
+    int bxc = block_size(nc, cl->nbx), byc = block_size(nc, cl->nby);
+    int ldf = GRID_PITCH(nf + 2), ldc = GRID_PITCH(nc + 2);
+    int *first = cl->first, *count = cl->count;
+    double (*w)[MG_TAPS] = cl->w;
+    double scale = cl->scale;
+
+    for (int ii=0; ii<cl->nbx; ii++) {
+        for (int jj=0; jj<cl->nby; jj++) {
+            int inf_i = 1 + ii * bxc;
+            int sup_i = ((inf_i + bxc) < nc + 1) ? inf_i + bxc : nc + 1;
+            int inf_j = 1 + jj * byc;
+            int sup_j = ((inf_j + byc) < nc + 1) ? inf_j + byc : nc + 1;
+            // fine rows and columns under the hats, and their neighbours
+            int lo_i = first[inf_i], hi_i = first[sup_i-1] + count[sup_i-1];
+            int lo_j = first[inf_j], hi_j = first[sup_j-1] + count[sup_j-1];
+            int b0 = (lo_i > 1 ? lo_i - 2 : 0) / bxf;
+            int b1 = (hi_i < nf ? hi_i - 1 : nf - 1) / bxf;
+            int c0 = (lo_j > 1 ? lo_j - 2 : 0) / byf;
+            int c1 = (hi_j < nf ? hi_j - 1 : nf - 1) / byf;
+            #pragma omp task depend(iterator(a=b0:b1+1, b=c0:c1+1),            \
+                                    in: uf[(1+a*bxf)*ldf+1+b*byf],             \
+                                        uf[(1+a*bxf)*ldf+1+b*byf+1],           \
+                                        gtok[(1+a*bxf)*ldf+1+b*byf])           \
+                             depend(out: gc[inf_i*ldc+inf_j], uc[inf_i*ldc+inf_j], \
+                                         uc[inf_i*ldc+inf_j+1])                \
+                             firstprivate(uf, gf, uc, gc, first, count, w)
+            {
+                MG_EVENT(l);
+                int rows = hi_i - lo_i, cols = sup_j - inf_j;
+                double *part = (double *) malloc(sizeof(double) * rows * cols);
+
+                for (int i = lo_i; i < hi_i; i++)
+                    for (int J = inf_j; J < sup_j; J++) {
+                        double s = 0.0;
+                        for (int t = 0; t < count[J]; t++) {
+                            int j = first[J] + t;
+                            double r = (gf ? gf[i*ldf+j] : 0.0) - 4.0 * uf[i*ldf+j] +
+                                       uf[i*ldf+j-1] + uf[i*ldf+j+1] +
+                                       uf[(i-1)*ldf+j] + uf[(i+1)*ldf+j];
+                            s += w[J][t] * r;
+                        }
+                        part[(i-lo_i)*cols + J-inf_j] = s;
+                    }
+
+                for (int I = inf_i; I < sup_i; I++)
+                    for (int J = inf_j; J < sup_j; J++) {
+                        double s = 0.0;
+                        for (int t = 0; t < count[I]; t++)
+                            s += w[I][t] * part[(first[I]+t-lo_i)*cols + J-inf_j];
+                        gc[I*ldc+J] = scale * s;
+                        uc[I*ldc+J] = 0.0;
+                    }
+
+                free(part);
+                MG_EVENT(0);
+            }
+        }
+    }
+}
+
+/*
+ * Add the bilinear interpolation of the correction of level l+1 to level l.
+ */
+static void mg_prolong(mg_t *mg, int l)
+{
+    mg_level_t *fl = &mg->level[l], *cl = &mg->level[l+1];
+    real_t *uf = fl->u, *uc = cl->u;
+    int nf = fl->n, nc = cl->n;
+    int bxf = block_size(nf, fl->nbx), byf = block_size(nf, fl->nby);
+    int bxc = block_size(nc, cl->nbx), byc = block_size(nc, cl->nby);
+    int ldf = GRID_PITCH(nf + 2), ldc = GRID_PITCH(nc + 2);
+    int *cell = cl->cell;
+    double *frac = cl->frac;
+
+    for (int ii=0; ii<fl->nbx; ii++) {
+        for (int jj=0; jj<fl->nby; jj++) {
+            int inf_i = 1 + ii * bxf;
+            int sup_i = ((inf_i + bxf) < nf + 1) ? inf_i + bxf : nf + 1;
+            int inf_j = 1 + jj * byf;
+            int sup_j = ((inf_j + byf) < nf + 1) ? inf_j + byf : nf + 1;
+            // interior coarse points around the block
+            int lo_i = cell[inf_i] > 1 ? cell[inf_i] : 1;
+            int hi_i = cell[sup_i-1] + 1 < nc ? cell[sup_i-1] + 1 : nc;
+            int lo_j = cell[inf_j] > 1 ? cell[inf_j] : 1;
+            int hi_j = cell[sup_j-1] + 1 < nc ? cell[sup_j-1] + 1 : nc;
+            int b0 = (lo_i - 1) / bxc, b1 = (hi_i - 1) / bxc;
+            int c0 = (lo_j - 1) / byc, c1 = (hi_j - 1) / byc;
+            #pragma omp task depend(iterator(a=b0:b1+1, b=c0:c1+1),            \
+                                    in: uc[(1+a*bxc)*ldc+1+b*byc],             \
+                                        uc[(1+a*bxc)*ldc+1+b*byc+1])           \
+                             depend(inout: uf[inf_i*ldf+inf_j], uf[inf_i*ldf+inf_j+1]) \
+                             firstprivate(uf, uc, cell, frac)
+            {
+                MG_EVENT(l);
+                for (int i = inf_i; i < sup_i; i++) {
+                    int ci = cell[i];
+                    double a = frac[i];
+                    for (int j = inf_j; j < sup_j; j++) {
+                        int cj = cell[j];
+                        double b = frac[j];
+                        uf[i*ldf+j] += (1-a) * ((1-b) * uc[ci*ldc+cj] + b * uc[ci*ldc+cj+1]) +
+                                       a * ((1-b) * uc[(ci+1)*ldc+cj] + b * uc[(ci+1)*ldc+cj+1]);
+                    }
+                }
+                MG_EVENT(0);
+            }
+        }
+    }
+}
+
+static void mg_cycle(mg_t *mg, int l, double *residual)
+{
+    if (l == mg->nlevels - 1) {
+        mg_solve(mg, l);
+        return;
+    }
+
+    for (int s = 0; s < MG_PRE; s++)
+        mg_smooth(mg, l, &mg->discard);
+    mg_restrict(mg, l + 1);
+    for (int k = 0; k < mg->gamma; k++)
+        mg_cycle(mg, l + 1, residual);
+    mg_prolong(mg, l);
+    for (int s = 0; s < MG_POST; s++)
+        mg_smooth(mg, l, (l == 0 && s == MG_POST - 1) ? residual : &mg->discard);
+}
+
+/*
+ * Build the coarse levels under the grid of param: their grids and the
+ * transfer tables between each of them and the level above.
+ */
+static mg_t *mg_create( algoparam_t *param )
+{
+    mg_t *mg = (mg_t *) calloc(1, sizeof(mg_t));
+    if( !mg )
+	return NULL;
+
+    mg->gamma = param->cycle;
+    mg->algorithm = param->algorithm;
+    mg->level[0].n = param->resolution;
+    mg->level[0].nbx = param->nbx;
+    mg->level[0].nby = param->nby;
+    mg->nlevels = 1;
+
+    while( mg->level[mg->nlevels-1].n > MG_COARSEST && mg->nlevels < MG_LEVELS )
+    {
+	mg_level_t *fl = &mg->level[mg->nlevels-1];
+	mg_level_t *cl = &mg->level[mg->nlevels];
+	unsigned nf = fl->n, nc = (nf + 1) / 2;
+	// coarse spacing in fine spacings
+	double rho = (double)(nf + 1) / (nc + 1);
+
+	cl->n = nc;
+	cl->nbx = block_count(nc, param->nbx < nc ? param->nbx : nc);
+	cl->nby = block_count(nc, param->nby < nc ? param->nby : nc);
+	cl->u = grid_alloc(nc + 2, nc + 2);
+	cl->g = grid_alloc(nc + 2, nc + 2);
+	cl->first = (int *) calloc(nc + 2, sizeof(int));
+	cl->count = (int *) calloc(nc + 2, sizeof(int));
+	cl->w = (double (*)[MG_TAPS]) calloc(nc + 2, sizeof(*cl->w));
+	cl->cell = (int *) calloc(nf + 2, sizeof(int));
+	cl->frac = (double *) calloc(nf + 2, sizeof(double));
+	cl->scale = rho * rho;
+	mg->nlevels++;
+	if( !cl->u || !cl->g || !cl->first || !cl->count || !cl->w ||
+	    !cl->cell || !cl->frac )
+	{
+	    mg_free(mg);
+	    return NULL;
+	}
+
+	// hats of half width rho, normalized over all the points under them
+	// so that the boundary, where the residual is zero, only drops terms
+	for( unsigned I=1; I<=nc; I++ )
+	{
+	    double t = I * rho, total = 0.0;
+	    int lo = (int)floor(t - rho) + 1, hi = (int)ceil(t + rho) - 1;
+
+	    for( int i=lo; i<=hi; i++ )
+		total += 1.0 - fabs(i - t) / rho;
+	    if( lo < 1 ) lo = 1;
+	    if( hi > (int)nf ) hi = nf;
+	    cl->first[I] = lo;
+	    cl->count[I] = hi - lo + 1;
+	    for( int i=lo; i<=hi; i++ )
+		cl->w[I][i-lo] = (1.0 - fabs(i - t) / rho) / total;
+	}
+
+	for( unsigned i=0; i<=nf+1; i++ )
+	{
+	    double s = i / rho;
+	    int c = (int)s;
+	    if( c > (int)nc )
+		c = nc;
+	    cl->cell[i] = c;
+	    cl->frac[i] = s - c;
+	}
+    }
+
+    return mg;
+}
+
+void mg_free( void *p )
+{
+    mg_t *mg = (mg_t *)p;
+
+    for( int l=1; l<mg->nlevels; l++ )
+    {
+	mg_level_t *lv = &mg->level[l];
+	if( lv->u ) grid_free(lv->u, lv->n + 2, lv->n + 2);
+	if( lv->g ) grid_free(lv->g, lv->n + 2, lv->n + 2);
+	free(lv->first);
+	free(lv->count);
+	free(lv->w);
+	free(lv->cell);
+	free(lv->frac);
+    }
+    free(mg);
+}
+
+/*
+ * Creates the tasks of one V-cycle (param->cycle 1) or W-cycle (2) on
+ * param->u, building the levels the first time. Like the solvers of
+ * heat.c, the residual of the last smoothing sweep of the finest level is
+ * added to *residual, or returned after waiting for the cycle with
+ * residual NULL.
+ */
+double relax_multigrid( algoparam_t *param, double *residual )
+{
+    double sum = 0.0;
+    double *res = residual ? residual : &sum;
+
+    if( !param->mg && !(param->mg = mg_create(param)) )
+    {
+	fprintf(stderr, "Error: Cannot allocate the multigrid levels\n");
+	exit(1);
+    }
+
+    mg_t *mg = (mg_t *)param->mg;
+    mg->level[0].u = param->u;
+    mg_cycle(mg, 0, res);
+
+    // without a residual slot the caller wants the finished cycle
+    if( !residual )
+    {
+	#pragma omp taskwait
+    }
+    return sum;
+}
@@ -7,10 +7,140 @@
 #include <stdio.h>
 #include <math.h>
 #include <float.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include "heat.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define HUGE_PAGE (2UL << 20)
+
+/*
+ * Bytes mapped for an nx x ny grid: whole huge pages with HEAT_HUGETLB,
+ * whole pages otherwise.
+ */
+static size_t grid_bytes( unsigned nx, unsigned ny )
+{
+#ifdef HEAT_HUGETLB
+    size_t page = HUGE_PAGE;
+#else
+    size_t page = sysconf(_SC_PAGESIZE);
+#endif
+    return (GRID_SPAN(nx, ny) * sizeof(real_t) + page - 1) / page * page;
+}
+
+/*
+ * Allocate a grid of nx rows of ny points with the layout of GRID_PITCH(). The memory is
+ * anonymous and page aligned, so column 1 of every row starts a cache line,
+ * and grids of at least a huge page ask for transparent huge pages to cut
+ * the TLB misses of the sweeps. Built with -DHEAT_HUGETLB the grids come
+ * from the reserved 2 MB pages of /proc/sys/vm/nr_hugepages when there are
+ * enough of them. The pages are not touched here, see first_touch().
+ */
+real_t *grid_alloc( unsigned nx, unsigned ny )
+{
+    size_t len = grid_bytes(nx, ny);
+    void *map = MAP_FAILED;
+
+#ifdef HEAT_HUGETLB
+    map = mmap(0, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if( map == MAP_FAILED )
+	map = mmap(0, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( map == MAP_FAILED )
+	return 0;
+#ifdef MADV_HUGEPAGE
+    if( len >= HUGE_PAGE )
+	madvise(map, len, MADV_HUGEPAGE);
+#endif
+
+    return (real_t *)map + HEAT_CL - 1;
+}
+
+void grid_free( real_t *u, unsigned nx, unsigned ny )
+{
+    munmap(u - (HEAT_CL - 1), grid_bytes(nx, ny));
+}
+
+/*
+ * Zero the nx x ny grid u in parallel, each thread writing the blocks that
+ * block_owner() gives it (the boundary goes with the adjacent blocks), so
+ * that the pages of a block are placed on the NUMA node of the thread that
+ * owns it. Run with OMP_PROC_BIND set so that threads stay on their node.
+ */
+static void first_touch( real_t *u, int nx, int ny, int nbx, int nby )
+{
+    int ld = GRID_PITCH(ny);
+    int bx = block_size(nx - 2, nbx);
+    int by = block_size(ny - 2, nby);
+
+    #pragma omp parallel
+    {
+#ifdef _OPENMP
+	int me = omp_get_thread_num();
+	int nthreads = omp_get_num_threads();
+#else
+	int me = 0, nthreads = 1;
+#endif
+	for( int ii=0; ii<nbx; ii++ )
+	    for( int jj=0; jj<nby; jj++ )
+	    {
+		if( block_owner(ii, jj, nbx, nby, nthreads) != me )
+		    continue;
+
+		int inf_i = 1 + ii * bx;
+		int sup_i = ((inf_i + bx) < nx - 1) ? inf_i + bx : nx - 1;
+		int inf_j = 1 + jj * by;
+		int sup_j = ((inf_j + by) < ny - 1) ? inf_j + by : ny - 1;
+		if( inf_i >= sup_i || inf_j >= sup_j )
+		    continue;
+
+		// extend the blocks at the edges over the boundary
+		if( inf_i == 1 ) inf_i = 0;
+		if( sup_i == nx - 1 ) sup_i = nx;
+		if( inf_j == 1 ) inf_j = 0;
+		if( sup_j == ny - 1 ) sup_j = ny;
+
+		for( int i=inf_i; i<sup_i; i++ )
+		    for( int j=inf_j; j<sup_j; j++ )
+			u[i*ld+j] = 0.0;
+	    }
+    }
+}
+
+/*
+ * Checkpoint files are a header padded to a page followed by the np x np
+ * grid as raw real_t values, laid out like grid_alloc() does, so both
+ * sides can map the grid directly.
+ */
+#define CKPT_MAGIC   "HEATCKPT"
+#define CKPT_VERSION 3
+#define CKPT_HEADER  4096
+
+#define CKPT_BYTES(np)   (CKPT_HEADER + GRID_SPAN(np, np) * sizeof(real_t))
+#define CKPT_GRID(map)   ((real_t *)((char *)(map) + CKPT_HEADER) + HEAT_CL - 1)
+#define CKPT_MAP(grid)   ((char *)((grid) - (HEAT_CL - 1)) - CKPT_HEADER)
+
+typedef struct
+{
+    char     magic[8];
+    unsigned version;
+    unsigned resolution;    // inner points, the grid has resolution+2 per side
+    unsigned sweeps;        // sweeps done when the grid was saved
+    unsigned precision;     // bytes per point, sizeof(real_t) of the writer
+    unsigned pitch;         // points between rows, GRID_PITCH() of the writer
+}
+ckpt_header_t;
+
 /*
  * Initialize the iterative solver
  * - allocate memory for matrices
@@ -23,12 +153,17 @@ int initialize( algoparam_t *param )
 
     // total number of points (including border)
     const int np = param->resolution + 2;
+    const int ld = GRID_PITCH(np);
+    // rows of the grids, the slab of global rows row0..row0+nx-1 of a
+    // multi-process run
+    const int nx = param->rows + 2;
+    const int row0 = param->row0;
     //
     // allocate memory
     //
-    (param->u)     = (double*)calloc( sizeof(double),np*np );
-    (param->uhelp) = (double*)calloc( sizeof(double),np*np );
-    (param->uvis)  = (double*)calloc( sizeof(double),
+    (param->u)     = grid_alloc( nx, np );
+    (param->uhelp) = grid_alloc( nx, np );
+    (param->uvis)  = (real_t*)calloc( sizeof(real_t),
 				      (param->visres+2) *
 				      (param->visres+2) );
   
@@ -39,10 +174,13 @@ int initialize( algoparam_t *param )
 	return 0;
     }
 
+    first_touch(param->u, nx, np, param->nbx, param->nby);
+    first_touch(param->uhelp, nx, np, param->nbx, param->nby);
+
     for( i=0; i<param->numsrcs; i++ )
     {
 	/* top row */
-	for( j=0; j<np; j++ )
+	for( j=0; j<np && row0 == 0; j++ )
 	{
 	    dist = sqrt( pow((double)j/(double)(np-1) - 
 			     param->heatsrcs[i].posx, 2)+
@@ -58,7 +196,7 @@ int initialize( algoparam_t *param )
 	}
       
 	/* bottom row */
-	for( j=0; j<np; j++ )
+	for( j=0; j<np && row0 + nx == np; j++ )
 	{
 	    dist = sqrt( pow((double)j/(double)(np-1) - 
 			     param->heatsrcs[i].posx, 2)+
@@ -66,7 +204,7 @@ int initialize( algoparam_t *param )
 	  
 	    if( dist <= param->heatsrcs[i].range )
 	    {
-		(param->u)[(np-1)*np+j]+=
+		(param->u)[(nx-1)*ld+j]+=
 		    (param->heatsrcs[i].range-dist) / 
 		    param->heatsrcs[i].range * 
 		    param->heatsrcs[i].temp;
@@ -76,13 +214,15 @@ int initialize( algoparam_t *param )
 	/* leftmost column */
 	for( j=1; j<np-1; j++ )
 	{
+	    if( j < row0 || j >= row0 + nx )
+		continue;
 	    dist = sqrt( pow(param->heatsrcs[i].posx, 2)+
 			 pow((double)j/(double)(np-1) - 
 			     param->heatsrcs[i].posy, 2)); 
 	  
 	    if( dist <= param->heatsrcs[i].range )
 	    {
-		(param->u)[ j*np ]+=
+		(param->u)[ (j-row0)*ld ]+=
 		    (param->heatsrcs[i].range-dist) / 
 		    param->heatsrcs[i].range *
 		    param->heatsrcs[i].temp;
@@ -92,13 +232,15 @@ int initialize( algoparam_t *param )
 	/* rightmost column */
 	for( j=1; j<np-1; j++ )
 	{
+	    if( j < row0 || j >= row0 + nx )
+		continue;
 	    dist = sqrt( pow(1-param->heatsrcs[i].posx, 2)+
 			 pow((double)j/(double)(np-1) - 
 			     param->heatsrcs[i].posy, 2)); 
 	  
 	    if( dist <= param->heatsrcs[i].range )
 	    {
-		(param->u)[ j*np+(np-1) ]+=
+		(param->u)[ (j-row0)*ld+(np-1) ]+=
 		    (param->heatsrcs[i].range-dist) /
 		    param->heatsrcs[i].range *
 		    param->heatsrcs[i].temp;
@@ -106,14 +248,248 @@ int initialize( algoparam_t *param )
 	}
     }
 
-    // Copy u into uhelp
-    double *putmp, *pu;
-    pu = param->u;
-    putmp = param->uhelp;
+    // Copy the boundary of u into uhelp, the interiors are both zero
+    for( j=0; j<np; j++ )
+    {
+	(param->uhelp)[j] = (param->u)[j];
+	(param->uhelp)[(nx-1)*ld+j] = (param->u)[(nx-1)*ld+j];
+    }
+    for( j=0; j<nx; j++ )
+    {
+	(param->uhelp)[j*ld] = (param->u)[j*ld];
+	(param->uhelp)[j*ld+(np-1)] = (param->u)[j*ld+(np-1)];
+    }
+
+    return 1;
+}
+
+/*
+ * Create path.sweeps.tmp with room for an np x np grid and map it; the grid
+ * written through the returned pointer becomes path on checkpoint_commit.
+ * Each checkpoint has its own file, so opening the next one never truncates
+ * a file whose copies are still in flight.
+ */
+real_t *checkpoint_open( const char *path, unsigned np, unsigned sweeps )
+{
+    char tmp[strlen(path) + 16];
+    size_t len = CKPT_BYTES(np);
+    void *map;
+    int fd;
+
+    sprintf(tmp, "%s.%u.tmp", path, sweeps);
+    if( (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 )
+    {
+	fprintf(stderr, "Error: Cannot create checkpoint \"%s\"\n", tmp);
+	return 0;
+    }
+    if( ftruncate(fd, len) != 0 ||
+	(map = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED )
+    {
+	fprintf(stderr, "Error: Cannot map checkpoint \"%s\"\n", tmp);
+	close(fd);
+	return 0;
+    }
+    close(fd);
+
+    return CKPT_GRID(map);
+}
+
+/*
+ * Write the header, unmap the grid and atomically replace path, so that an
+ * interrupted checkpoint never clobbers the previous one. The pages reach
+ * the disk through the normal writeback, without stalling the solver.
+ */
+int checkpoint_commit( const char *path, real_t *grid, unsigned np,
+		       unsigned sweeps )
+{
+    char tmp[strlen(path) + 16];
+    void *map = CKPT_MAP(grid);
+    ckpt_header_t *header = (ckpt_header_t *) map;
+
+    memcpy(header->magic, CKPT_MAGIC, sizeof(header->magic));
+    header->version = CKPT_VERSION;
+    header->resolution = np - 2;
+    header->sweeps = sweeps;
+    header->precision = sizeof(real_t);
+    header->pitch = GRID_PITCH(np);
+    munmap(map, CKPT_BYTES(np));
+
+    sprintf(tmp, "%s.%u.tmp", path, sweeps);
+    if( rename(tmp, path) != 0 )
+    {
+	fprintf(stderr, "Error: Cannot rename checkpoint to \"%s\"\n", path);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * Replace initialize() by the grid of a checkpoint. The file is mapped
+ * privately, so the grid is read on demand by the page faults of the first
+ * sweep and never written back. Sets the resolution and returns the sweeps
+ * already done.
+ */
+int checkpoint_restore( const char *path, algoparam_t *param,
+			unsigned *sweeps )
+{
+    ckpt_header_t header;
+    struct stat st;
+    int fd;
+
+    if( (fd = open(path, O_RDONLY)) < 0 )
+	return 0;
+    if( read(fd, &header, sizeof(header)) != sizeof(header) ||
+	memcmp(header.magic, CKPT_MAGIC, sizeof(header.magic)) != 0 ||
+	header.version != CKPT_VERSION )
+    {
+	fprintf(stderr, "Error: \"%s\" is not a heat checkpoint\n", path);
+	close(fd);
+	return 0;
+    }
+
+    const int np = header.resolution + 2;
+    const int ld = GRID_PITCH(np);
+    if( header.precision != sizeof(real_t) || header.pitch != ld )
+    {
+	fprintf(stderr, "Error: Checkpoint \"%s\" was written with %u-byte points %u apart, not %zu and %d\n",
+		path, header.precision, header.pitch, sizeof(real_t), ld);
+	close(fd);
+	return 0;
+    }
+
+    param->maplen = CKPT_BYTES(np);
+    if( fstat(fd, &st) != 0 || st.st_size < param->maplen )
+    {
+	fprintf(stderr, "Error: Checkpoint \"%s\" is truncated\n", path);
+	close(fd);
+	return 0;
+    }
+
+    param->map = mmap(0, param->maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( param->map == MAP_FAILED )
+    {
+	param->map = 0;
+	return 0;
+    }
+
+    param->resolution = header.resolution;
+    param->u = CKPT_GRID(param->map);
+    *sweeps = header.sweeps;
+
+    // Jacobi writes its first sweep into uhelp, which needs the boundary
+    (param->uhelp) = grid_alloc( np, np );
+    (param->uvis)  = (real_t*)calloc( sizeof(real_t),
+				      (param->visres+2) *
+				      (param->visres+2) );
+    if( !(param->uhelp) || !(param->uvis) )
+    {
+	fprintf(stderr, "Error: Cannot allocate memory\n");
+	return 0;
+    }
+
+    first_touch(param->uhelp, np, np, param->nbx, param->nby);
     for( int j=0; j<np; j++ )
-	for( int i=0; i<np; i++ )
-	    *putmp++ = *pu++;
+    {
+	(param->uhelp)[j] = (param->u)[j];
+	(param->uhelp)[(np-1)*ld+j] = (param->u)[(np-1)*ld+j];
+	(param->uhelp)[j*ld] = (param->u)[j*ld];
+	(param->uhelp)[j*ld+(np-1)] = (param->u)[j*ld+(np-1)];
+    }
+
+    return 1;
+}
+
+/*
+ * Tuning file of --tune: one line per decomposition found, keyed by host,
+ * resolution, threads, algorithm and depth,
+ *   host resolution threads algorithm depth nbx nby seconds-per-sweep
+ * Returns whether line holds the entry of param on this host and threads,
+ * and then its block counts.
+ */
+static int tune_match( const char *line, const char *host, algoparam_t *param,
+		       int threads, unsigned *nbx, unsigned *nby )
+{
+    char h[256];
+    unsigned resolution, depth;
+    int thr, algorithm;
+    double t;
+
+    return sscanf(line, "%255s %u %d %d %u %u %u %lf", h, &resolution, &thr,
+		  &algorithm, &depth, nbx, nby, &t) == 8 &&
+	strcmp(h, host) == 0 && resolution == param->resolution &&
+	thr == threads && algorithm == param->algorithm &&
+	depth == param->depth;
+}
+
+static void tune_host( char *host, size_t len )
+{
+    if( gethostname(host, len) != 0 )
+	strcpy(host, "unknown");
+    host[len-1] = '\0';
+}
+
+/*
+ * Set param->nbx and param->nby to the decomposition tuned for param on
+ * this host with the given threads, if path has one.
+ */
+int tune_lookup( const char *path, algoparam_t *param, int threads )
+{
+    char host[256], line[512];
+    unsigned nbx, nby;
+    int found = 0;
+    FILE *f;
+
+    if( !(f = fopen(path, "r")) )
+	return 0;
+    tune_host(host, sizeof(host));
+    while( fgets(line, sizeof(line), f) )
+	if( tune_match(line, host, param, threads, &nbx, &nby) )
+	{
+	    param->nbx = nbx;
+	    param->nby = nby;
+	    found = 1;
+	}
+    fclose(f);
+    return found;
+}
+
+/*
+ * Store the decomposition of param in path, replacing an older entry with
+ * the same key. The file is rewritten as path.tmp and renamed, like the
+ * checkpoints.
+ */
+int tune_record( const char *path, algoparam_t *param, int threads,
+		 double time )
+{
+    char tmp[strlen(path) + 5];
+    char host[256], line[512];
+    unsigned nbx, nby;
+    FILE *in, *out;
+
+    sprintf(tmp, "%s.tmp", path);
+    if( !(out = fopen(tmp, "w")) )
+    {
+	fprintf(stderr, "Error: Cannot write tuning file \"%s\"\n", tmp);
+	return 0;
+    }
+    tune_host(host, sizeof(host));
+    if( (in = fopen(path, "r")) )
+    {
+	while( fgets(line, sizeof(line), in) )
+	    if( !tune_match(line, host, param, threads, &nbx, &nby) )
+		fputs(line, out);
+	fclose(in);
+    }
+    fprintf(out, "%s %u %d %d %u %u %u %e\n", host, param->resolution, threads,
+	    param->algorithm, param->depth, param->nbx, param->nby, time);
+    fclose(out);
 
+    if( rename(tmp, path) != 0 )
+    {
+	fprintf(stderr, "Error: Cannot rename tuning file to \"%s\"\n", path);
+	return 0;
+    }
     return 1;
 }
 
@@ -122,13 +498,24 @@ int initialize( algoparam_t *param )
  */
 int finalize( algoparam_t *param )
 {
+    // after a restart one of the grids lives in the checkpoint mapping
+    if( param->map ) {
+	real_t *grid = CKPT_GRID(param->map);
+	if( param->u == grid )
+	    param->u = 0;
+	if( param->uhelp == grid )
+	    param->uhelp = 0;
+	munmap(param->map, param->maplen);
+	param->map = 0;
+    }
+
     if( param->u ) {
-	free(param->u);
+	grid_free(param->u, param->rows + 2, param->resolution + 2);
 	param->u = 0;
     }
 
     if( param->uhelp ) {
-	free(param->uhelp);
+	grid_free(param->uhelp, param->rows + 2, param->resolution + 2);
 	param->uhelp = 0;
     }
 
@@ -143,14 +530,14 @@ int finalize( algoparam_t *param )
 
 /*
  * write the given temperature u matrix to rgb values
- * and write the resulting image to file f
+ * and write the resulting image to file f as a binary PPM (P6)
  */
-void write_image( FILE * f, double *u,
+void write_image( FILE * f, real_t *u,
 		  unsigned sizex, unsigned sizey ) 
 {
     // RGB table
     unsigned char r[1024], g[1024], b[1024];
-    int i, j, k;
+    int i, j;
   
     double min, max;
 
@@ -181,67 +568,90 @@ void write_image( FILE * f, double *u,
     min=DBL_MAX;
     max=-DBL_MAX;
 
+    const long npix = (long)sizex * sizey;
+
     // find minimum and maximum 
-    for( i=0; i<sizey; i++ )
+    #pragma omp parallel for reduction(min: min) reduction(max: max)
+    for( long p=0; p<npix; p++ )
     {
-	for( j=0; j<sizex; j++ )
-	{
-	    if( u[i*sizex+j]>max )
-		max=u[i*sizex+j];
-	    if( u[i*sizex+j]<min )
-		min=u[i*sizex+j];
-	}
+	if( u[p]>max )
+	    max=u[p];
+	if( u[p]<min )
+	    min=u[p];
     }
-  
 
-    fprintf(f, "P3\n");
-    fprintf(f, "%u %u\n", sizex, sizey);
-    fprintf(f, "%u\n", 255);
+    // colour the whole image in memory and write it at once
+    unsigned char *rgb = (unsigned char *) malloc( 3 * npix );
+    if( !rgb )
+    {
+	fprintf(stderr, "Error: Cannot allocate memory for the image\n");
+	return;
+    }
 
-    for( i=0; i<sizey; i++ )
+    const double scale = (max > min) ? 1023.0 / (max - min) : 0.0;
+
+    #pragma omp parallel for
+    for( long p=0; p<npix; p++ )
     {
-	for( j=0; j<sizex; j++ )
-	{
-	    k=(int)(1023.0*(u[i*sizex+j]-min)/(max-min));
-	    fprintf(f, "%d %d %d  ", r[k], g[k], b[k]);
-	}
-	fprintf(f, "\n");
+	int k=(int)(scale*(u[p]-min));
+	rgb[3*p]   = r[k];
+	rgb[3*p+1] = g[k];
+	rgb[3*p+2] = b[k];
     }
+
+    fprintf(f, "P6\n");
+    fprintf(f, "%u %u\n", sizex, sizey);
+    fprintf(f, "%u\n", 255);
+    fwrite(rgb, 3, npix, f);
+
+    free(rgb);
 }
 
 
-int coarsen( double *uold, unsigned oldx, unsigned oldy ,
-	     double *unew, unsigned newx, unsigned newy )
+/*
+ * Rows inf_i..sup_i-1 and columns inf_j..sup_j-1 of the newx x newy
+ * average of uold that coarsen() computes, so that tasks can coarsen
+ * parts of a grid.
+ */
+void coarsen_block( real_t *uold, unsigned oldx, unsigned oldy, unsigned oldld,
+		    real_t *unew, unsigned newx, unsigned newy,
+		    unsigned inf_i, unsigned sup_i, unsigned inf_j, unsigned sup_j )
 {
-    int i, j;
+    for( unsigned i=inf_i; i<sup_i; i++ )
+    {
+	long i0 = (long)i * oldy / newy;
+	long i1 = (long)(i+1) * oldy / newy;
 
-    int stepx;
-    int stepy;
-    int stopx = newx;
-    int stopy = newy;
+	for( unsigned j=inf_j; j<sup_j; j++ )
+        {
+	    long j0 = (long)j * oldx / newx;
+	    long j1 = (long)(j+1) * oldx / newx;
+	    double sum = 0.0;
 
-    if (oldx>newx)
-	stepx=oldx/newx;
-    else {
-	stepx=1;
-	stopx=oldx;
-    }
-    if (oldy>newy)
-	stepy=oldy/newy;
-    else {
-	stepy=1;
-	stopy=oldy;
-    }
+	    for( long ii=i0; ii<i1; ii++ )
+		for( long jj=j0; jj<j1; jj++ )
+		    sum += uold[ii*oldld+jj];
 
-    // NOTE: this only takes the top-left corner,
-    // and doesnt' do any real coarsening 
-    for( i=0; i<stopy-1; i++ )
-    {
-	for( j=0; j<stopx-1; j++ )
-        {
-	    unew[i*newx+j]=uold[i*oldx*stepy+j*stepx];
+	    unew[i*newx+j] = sum / ((i1-i0) * (j1-j0));
         }
     }
+}
+
+/*
+ * Area-average uold (oldx columns by oldy rows, oldld points apart) into
+ * the first newx x newy points of unew: every new point is the mean of the old points that fall
+ * into it, which also works when the sizes are not multiples of each
+ * other. A grid that is already smaller is copied as is.
+ */
+int coarsen( real_t *uold, unsigned oldx, unsigned oldy , unsigned oldld,
+	     real_t *unew, unsigned newx, unsigned newy )
+{
+    int stopx = (oldx < newx) ? oldx : newx;
+    int stopy = (oldy < newy) ? oldy : newy;
+
+    #pragma omp parallel for
+    for( int i=0; i<stopy; i++ )
+	coarsen_block(uold, oldx, oldy, oldld, unew, stopx, stopy, i, i+1, 0, stopx);
 
   return 1;
 }
@@ -277,19 +687,29 @@ int read_input( FILE *infile, algoparam_t *param )
   (param->heatsrcs) = 
     (heatsrc_t*) malloc( sizeof(heatsrc_t) * (param->numsrcs) );
   
+  // x y range temperature, or x y z range temperature for heat3d
   for( i=0; i<param->numsrcs; i++ )
     {
+      float v[5];
+
       fgets(buf, BUFSIZE, infile);
-      n = sscanf( buf, "%f %f %f %f",
-		  &(param->heatsrcs[i].posx),
-		  &(param->heatsrcs[i].posy),
-		  &(param->heatsrcs[i].range),
-		  &(param->heatsrcs[i].temp) );
+      n = sscanf( buf, "%f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4] );
 
-      if( n!=4 )
+      if( n!=4 && n!=5 )
 	return 0;
+
+      param->heatsrcs[i].posx = v[0];
+      param->heatsrcs[i].posy = v[1];
+      param->heatsrcs[i].posz = (n == 5) ? v[2] : 0.0;
+      param->heatsrcs[i].range = v[n-2];
+      param->heatsrcs[i].temp = v[n-1];
     }
 
+  // optional convergence tolerance after the heat sources
+  param->tolerance = 0.0;
+  if( fgets(buf, BUFSIZE, infile) )
+    sscanf(buf, "%lf", &(param->tolerance) );
+
   return 1;
 }
 
@@ -302,7 +722,10 @@ void print_params( algoparam_t *param )
   fprintf(stdout, "Resolution        : %u\n", param->resolution);
   fprintf(stdout, "Algorithm         : %d (%s)\n",
 	  param->algorithm,
-	  (param->algorithm == 0) ? "Jacobi":(param->algorithm ==2) ? "Red-Black":"Gauss-Seidel" );
+	  (param->algorithm == 0) ? "Jacobi":(param->algorithm ==2) ? "Red-Black":
+	  (param->algorithm == 3) ? "Conjugate Gradient":"Gauss-Seidel" );
+  if( param->tolerance > 0.0 )
+    fprintf(stdout, "Tolerance         : %e\n", param->tolerance);
   fprintf(stdout, "Num. Heat sources : %u\n", param->numsrcs);
 
   for( i=0; i<param->numsrcs; i++ )
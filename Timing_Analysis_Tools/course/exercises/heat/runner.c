@@ -0,0 +1,339 @@
+//
+// This file is part of Heat Gauss Seidel  and is licensed under the terms contained in the COPYING file.
+// Copyright (C) 2015-2020 Barcelona Supercomputing Center (BSC)
+//
+
+/*
+ * Runs a batch of heat simulations side by side. The CPUs the runner may
+ * use are split into groups of contiguous CPUs, and every group runs one
+ * heat process at a time, pinned to the group with as many OpenMP threads
+ * as it has CPUs, so the simulations never compete for cores. The inputs
+ * are queued largest first (resolution^2 x iterations, as read from the
+ * input file) and a group takes the next one as soon as it is free.
+ *
+ * The output of the simulation of dir/name.dat goes to name.log and its
+ * image to name.ppm, where name is the path of the input below the
+ * directory common to all of them, with / replaced by _, so that inputs
+ * with the same file name in different directories keep their outputs.
+ * At the end the runner reports, for every input, the time it waited for
+ * a group, the time it ran and the response time, which is their sum.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+
+// default heat binary, overridden with -x
+#define RUNNER_HEAT "./heat"
+
+typedef struct
+{
+    char *input;
+    char *name;             // of the outputs, name.log and name.ppm
+    double cost;            // resolution^2 x iterations, for the queue order
+    int group;              // group that ran it, -1 while queued
+    pid_t pid;
+    int status;
+    double start, end;      // since the start of the batch
+}
+instance_t;
+
+typedef struct
+{
+    cpu_set_t cpus;
+    int ncpus;
+    int busy;               // instance running on the group, -1 if free
+}
+group_t;
+
+void usage( char *s )
+{
+    fprintf(stderr, "Usage: %s [-g groups] [-x heat] <input file>... [-- heat options]\n\n", s);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// iterations and resolution are the first two lines of the input
+static double input_cost( const char *path )
+{
+    unsigned maxiter, resolution;
+    char buf[100];
+    int n = 0;
+    FILE *f = fopen(path, "r");
+
+    if( !f )
+	return -1.0;
+    if( fgets(buf, sizeof(buf), f) )
+	n += sscanf(buf, "%u", &maxiter);
+    if( fgets(buf, sizeof(buf), f) )
+	n += sscanf(buf, "%u", &resolution);
+    fclose(f);
+    return (n == 2) ? (double)resolution * resolution * maxiter : -1.0;
+}
+
+/*
+ * Name the outputs of the ninputs instances after their inputs, relative
+ * to the longest directory all of them are in and without the extension.
+ * Returns 0 if two inputs would still write the same files.
+ */
+static int output_names( instance_t *instance, int ninputs )
+{
+    const char *first = instance[0].input;
+    const char *slash = strrchr(first, '/');
+    size_t root = slash ? slash - first + 1 : 0;
+
+    for( int i=1; i<ninputs; i++ )
+	while( root > 0 && strncmp(instance[i].input, first, root) )
+	{
+	    // up to the previous / of the first input
+	    root--;
+	    while( root > 0 && first[root-1] != '/' )
+		root--;
+	}
+
+    for( int i=0; i<ninputs; i++ )
+    {
+	// without the leading /, ./ and ../, which would hide the outputs
+	const char *rel = instance[i].input + root;
+	while( *rel == '/' || !strncmp(rel, "./", 2) || !strncmp(rel, "../", 3) )
+	    rel += (*rel == '/') ? 1 : (rel[1] == '/') ? 2 : 3;
+
+	char *name = strdup(rel);
+	char *base = strrchr(name, '/');
+	char *dot = strrchr(base ? base + 1 : name, '.');
+	if( dot && dot != (base ? base + 1 : name) )
+	    *dot = '\0';
+	for( char *c = name; *c; c++ )
+	    if( *c == '/' )
+		*c = '_';
+	instance[i].name = name;
+    }
+
+    for( int i=0; i<ninputs; i++ )
+	for( int j=0; j<i; j++ )
+	    if( !strcmp(instance[i].name, instance[j].name) )
+	    {
+		fprintf(stderr, "\nError: \"%s\" and \"%s\" would both write %s.log and %s.ppm.\n\n",
+			instance[j].input, instance[i].input, instance[i].name, instance[i].name);
+		return 0;
+	    }
+    return 1;
+}
+
+static int by_cost( const void *a, const void *b )
+{
+    double ca = ((const instance_t *)a)->cost;
+    double cb = ((const instance_t *)b)->cost;
+    return (ca < cb) - (ca > cb);
+}
+
+/*
+ * Split the CPUs in all into ngroups groups of contiguous CPUs.
+ * With fewer CPUs than groups every group gets all of them.
+ */
+static void split_cpus( cpu_set_t *all, group_t *group, int ngroups )
+{
+    int cpus[CPU_SETSIZE], ncpus = 0;
+
+    for( int c=0; c<CPU_SETSIZE; c++ )
+	if( CPU_ISSET(c, all) )
+	    cpus[ncpus++] = c;
+
+    for( int g=0; g<ngroups; g++ )
+    {
+	int lo = (ncpus < ngroups) ? 0 : (long)g * ncpus / ngroups;
+	int hi = (ncpus < ngroups) ? ncpus : (long)(g + 1) * ncpus / ngroups;
+
+	CPU_ZERO(&group[g].cpus);
+	for( int c=lo; c<hi; c++ )
+	    CPU_SET(cpus[c], &group[g].cpus);
+	group[g].ncpus = hi - lo;
+	group[g].busy = -1;
+    }
+}
+
+/*
+ * Start instance on group: the child pins itself to the CPUs of the group
+ * and runs heat [options] input name.ppm with stdout and stderr in
+ * name.log.
+ */
+static pid_t launch( const char *heat, char **options, int noptions,
+		     instance_t *instance, group_t *group )
+{
+    const char *name = instance->name;
+    char log[strlen(name) + 5], ppm[strlen(name) + 5];
+    sprintf(log, "%s.log", name);
+    sprintf(ppm, "%s.ppm", name);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if( pid != 0 )
+	return pid;
+
+    char threads[16];
+    sprintf(threads, "%d", group->ncpus);
+    setenv("OMP_NUM_THREADS", threads, 1);
+    setenv("OMP_PROC_BIND", "true", 0);
+    sched_setaffinity(0, sizeof(group->cpus), &group->cpus);
+
+    int fd = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if( fd >= 0 )
+    {
+	dup2(fd, 1);
+	dup2(fd, 2);
+	close(fd);
+    }
+
+    char *argv[noptions + 4];
+    argv[0] = (char *)heat;
+    for( int i=0; i<noptions; i++ )
+	argv[i+1] = options[i];
+    argv[noptions+1] = instance->input;
+    argv[noptions+2] = ppm;
+    argv[noptions+3] = NULL;
+
+    execv(heat, argv);
+    perror(heat);
+    _exit(127);
+}
+
+int main( int argc, char *argv[] )
+{
+    char *heat = RUNNER_HEAT;
+    int ngroups = 0;
+    int opt;
+
+    // options of the runner stop at the first input file
+    while( (opt = getopt(argc, argv, "+g:x:")) != -1 )
+    {
+	switch( opt )
+	{
+	case 'g': ngroups = atoi(optarg); break;
+	case 'x': heat = optarg; break;
+	default:
+	    usage( argv[0] );
+	    return 1;
+	}
+    }
+
+    int ninputs = 0;
+    while( optind + ninputs < argc && strcmp(argv[optind + ninputs], "--") )
+	ninputs++;
+    char **options = &argv[optind + ninputs];
+    int noptions = argc - optind - ninputs;
+    if( noptions > 0 )
+    {
+	options++;
+	noptions--;
+    }
+
+    if( ninputs == 0 || ngroups < 0 )
+    {
+	usage( argv[0] );
+	return 1;
+    }
+
+    instance_t *instance = (instance_t *) calloc(ninputs, sizeof(instance_t));
+    for( int i=0; i<ninputs; i++ )
+    {
+	instance[i].input = argv[optind + i];
+	instance[i].cost = input_cost(instance[i].input);
+	instance[i].group = -1;
+	if( instance[i].cost < 0.0 )
+	{
+	    fprintf(stderr, "\nError: Cannot read \"%s\".\n\n", instance[i].input);
+	    return 1;
+	}
+    }
+    if( !output_names(instance, ninputs) )
+	return 1;
+    qsort(instance, ninputs, sizeof(instance_t), by_cost);
+
+    // by default one group per input, as long as there are CPUs for them
+    cpu_set_t all;
+    if( sched_getaffinity(0, sizeof(all), &all) )
+    {
+	perror("sched_getaffinity");
+	return 1;
+    }
+    int ncpus = CPU_COUNT(&all);
+    if( ngroups == 0 )
+	ngroups = (ninputs < ncpus) ? ninputs : ncpus;
+    if( ncpus < ngroups )
+	fprintf(stderr, "Warning: %d groups share %d CPUs\n", ngroups, ncpus);
+
+    group_t *group = (group_t *) calloc(ngroups, sizeof(group_t));
+    split_cpus(&all, group, ngroups);
+
+    double t0 = now();
+    int next = 0, running = 0, failed = 0;
+
+    while( next < ninputs || running > 0 )
+    {
+	// fill the free groups
+	for( int g=0; g<ngroups && next < ninputs; g++ )
+	{
+	    if( group[g].busy >= 0 )
+		continue;
+	    instance_t *in = &instance[next];
+	    in->group = g;
+	    in->start = now() - t0;
+	    in->pid = launch(heat, options, noptions, in, &group[g]);
+	    if( in->pid < 0 )
+	    {
+		perror("fork");
+		return 1;
+	    }
+	    group[g].busy = next++;
+	    running++;
+	}
+
+	int status;
+	pid_t pid = wait(&status);
+	if( pid < 0 )
+	    break;
+	for( int g=0; g<ngroups; g++ )
+	{
+	    int i = group[g].busy;
+	    if( i < 0 || instance[i].pid != pid )
+		continue;
+	    instance[i].end = now() - t0;
+	    instance[i].status = status;
+	    if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+		failed++;
+	    group[g].busy = -1;
+	    running--;
+	}
+    }
+    double makespan = now() - t0;
+
+    fprintf(stdout, "%-24s %5s %4s %10s %10s %10s\n",
+	    "input", "group", "cpus", "wait", "run", "response");
+    for( int i=0; i<ninputs; i++ )
+    {
+	instance_t *in = &instance[i];
+	fprintf(stdout, "%-24s %5d %4d %10.3f %10.3f %10.3f%s\n",
+		in->input, in->group, group[in->group].ncpus,
+		in->start, in->end - in->start, in->end,
+		(WIFEXITED(in->status) && WEXITSTATUS(in->status) == 0) ? "" : " failed");
+    }
+    fprintf(stdout, "%d simulations on %d CPUs in %d groups: %.3f s, %.3f per second\n",
+	    ninputs, ncpus, ngroups, makespan, ninputs / makespan);
+
+    for( int i=0; i<ninputs; i++ )
+	free(instance[i].name);
+    free(group);
+    free(instance);
+    return failed ? 1 : 0;
+}
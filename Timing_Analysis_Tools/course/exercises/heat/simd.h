@@ -0,0 +1,301 @@
+//
+// Explicitly vectorized block kernels of the heat solvers, used by heat.c
+// when the compiler targets AVX2 or AVX-512 (e.g. -march=native), in the
+// precision of real_t (heat.h). Define HEAT_NO_SIMD to keep the scalar kernels.
+//
+#ifndef __HEAT_SIMD__
+#define __HEAT_SIMD__
+
+#if !defined(HEAT_NO_SIMD) && (defined(__AVX512F__) || defined(__AVX2__))
+#include <immintrin.h>
+
+#if defined(__AVX512F__) && !defined(HEAT_FLOAT)
+
+#define HEAT_VL 8
+typedef __m512d vec_t;
+typedef __m512i vidx_t;
+typedef __mmask8 vmask_t;
+
+#define VSET1(x)            _mm512_set1_pd(x)
+#define VLOAD(p)            _mm512_loadu_pd(p)
+#define VSTORE(p, v)        _mm512_storeu_pd(p, v)
+#define VADD(a, b)          _mm512_add_pd(a, b)
+#define VSUB(a, b)          _mm512_sub_pd(a, b)
+#define VMUL(a, b)          _mm512_mul_pd(a, b)
+#define VSELECT(m, a, b)    _mm512_mask_blend_pd(m, b, a)
+#define VHSUM(v)            _mm512_reduce_add_pd(v)
+#define VMASK_EVEN          ((vmask_t) 0x55)
+#define VMASK_ODD           ((vmask_t) 0xAA)
+// lane k of the index vector is k*stride, without the AVX512DQ multiply
+#define VIDX(stride)        _mm512_set_epi64(7*(long long)(stride), 6*(long long)(stride), \
+                                             5*(long long)(stride), 4*(long long)(stride), \
+                                             3*(long long)(stride), 2*(long long)(stride), \
+                                             (long long)(stride), 0)
+#define VGATHER(p, idx)     _mm512_i64gather_pd(idx, p, 8)
+#define VSCATTER(p, idx, stride, v) _mm512_i64scatter_pd(p, idx, v, 8)
+// lanes move up by one, lane 0 takes x
+#define VSHIFT_IN(v, x)     _mm512_mask_blend_pd(0x1,                                          \
+                                _mm512_permutexvar_pd(_mm512_set_epi64(6, 5, 4, 3, 2, 1, 0, 0), v), \
+                                _mm512_set1_pd(x))
+
+#elif !defined(HEAT_FLOAT) // __AVX2__
+
+#define HEAT_VL 4
+typedef __m256d vec_t;
+typedef __m256i vidx_t;
+typedef __m256d vmask_t;
+
+#define VSET1(x)            _mm256_set1_pd(x)
+#define VLOAD(p)            _mm256_loadu_pd(p)
+#define VSTORE(p, v)        _mm256_storeu_pd(p, v)
+#define VADD(a, b)          _mm256_add_pd(a, b)
+#define VSUB(a, b)          _mm256_sub_pd(a, b)
+#define VMUL(a, b)          _mm256_mul_pd(a, b)
+#define VSELECT(m, a, b)    _mm256_blendv_pd(b, a, m)
+#define VMASK_EVEN          _mm256_castsi256_pd(_mm256_set_epi64x(0, -1, 0, -1))
+#define VMASK_ODD           _mm256_castsi256_pd(_mm256_set_epi64x(-1, 0, -1, 0))
+#define VIDX(stride)        _mm256_set_epi64x(3*(long long)(stride), 2*(long long)(stride), \
+                                              (long long)(stride), 0)
+#define VGATHER(p, idx)     _mm256_i64gather_pd(p, idx, 8)
+#define VSHIFT_IN(v, x)     _mm256_blend_pd(_mm256_permute4x64_pd(v, _MM_SHUFFLE(2, 1, 0, 0)), \
+                                            _mm256_set1_pd(x), 0x1)
+
+static inline double VHSUM(vec_t v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+// AVX2 has no scatter
+static inline void VSCATTER_AVX2(double *p, long stride, vec_t v)
+{
+    double lane[4];
+    _mm256_storeu_pd(lane, v);
+    p[0] = lane[0]; p[stride] = lane[1]; p[2*stride] = lane[2]; p[3*stride] = lane[3];
+}
+#define VSCATTER(p, idx, stride, v) VSCATTER_AVX2(p, stride, v)
+
+#else // float
+
+/*
+ * Floats use 256-bit vectors even with AVX-512: the 16 rows gathered by
+ * gauss_block_simd() map to the same cache sets on the power-of-two grids
+ * and made the 512-bit version slower than this one.
+ */
+
+#define HEAT_VL 8
+typedef __m256 vec_t;
+typedef __m256i vidx_t;
+typedef __m256 vmask_t;
+
+#define VSET1(x)            _mm256_set1_ps(x)
+#define VLOAD(p)            _mm256_loadu_ps(p)
+#define VSTORE(p, v)        _mm256_storeu_ps(p, v)
+#define VADD(a, b)          _mm256_add_ps(a, b)
+#define VSUB(a, b)          _mm256_sub_ps(a, b)
+#define VMUL(a, b)          _mm256_mul_ps(a, b)
+#define VSELECT(m, a, b)    _mm256_blendv_ps(b, a, m)
+#define VMASK_EVEN          _mm256_castsi256_ps(_mm256_set_epi32(0, -1, 0, -1, 0, -1, 0, -1))
+#define VMASK_ODD           _mm256_castsi256_ps(_mm256_set_epi32(-1, 0, -1, 0, -1, 0, -1, 0))
+#define VIDX(stride)        _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), \
+                                               _mm256_set1_epi32(stride))
+#define VGATHER(p, idx)     _mm256_i32gather_ps(p, idx, 4)
+#define VSHIFT_IN(v, x)     _mm256_blend_ps(_mm256_permutevar8x32_ps(v, _mm256_set_epi32(6, 5, 4, 3, 2, 1, 0, 0)), \
+                                            _mm256_set1_ps(x), 0x1)
+
+static inline float VHSUM(vec_t v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+}
+
+static inline void VSCATTER_AVX2(float *p, long stride, vec_t v)
+{
+    float lane[8];
+    _mm256_storeu_ps(lane, v);
+    for (int k = 0; k < 8; ++k)
+        p[k*stride] = lane[k];
+}
+#define VSCATTER(p, idx, stride, v) VSCATTER_AVX2(p, stride, v)
+
+// the two halves of a float vector widened to double
+#define VWIDEN_LO(v)        _mm256_cvtps_pd(_mm256_castps256_ps128(v))
+#define VWIDEN_HI(v)        _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1))
+typedef __m256d vdouble_t;
+#define VADD_PD(a, b)       _mm256_add_pd(a, b)
+#define VMUL_PD(a, b)       _mm256_mul_pd(a, b)
+#define VSET1_PD(x)         _mm256_set1_pd(x)
+
+static inline double VHSUM_PD(vdouble_t v)
+{
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+#endif
+
+/*
+ * Accumulator of the squared updates. It has the precision of the grid,
+ * except in mixed precision, where the float differences are widened and
+ * summed in double.
+ */
+#ifdef HEAT_MIXED
+typedef vdouble_t vacc_t;
+#define VACC_ZERO           VSET1_PD(0.0)
+#define VACC_SUM(acc)       VHSUM_PD(acc)
+static inline vacc_t VACC(vacc_t acc, vec_t diff)
+{
+    vdouble_t lo = VWIDEN_LO(diff), hi = VWIDEN_HI(diff);
+    return VADD_PD(VADD_PD(acc, VMUL_PD(lo, lo)), VMUL_PD(hi, hi));
+}
+#else
+typedef vec_t vacc_t;
+#define VACC_ZERO           VSET1(0.0)
+#define VACC_SUM(acc)       VHSUM(acc)
+#define VACC(acc, diff)     VADD(acc, VMUL(diff, diff))
+#endif
+
+/*
+ * The vector kernels compute 0.25 * (((left + right) + up) + down) like the
+ * scalar ones, so both give bit-identical grids; only the order in which
+ * the residual is accumulated differs.
+ */
+
+static inline double jacobi_block_simd(const int ld, real_t *u, real_t *utmp,
+                                       int inf_i, int sup_i, int inf_j, int sup_j)
+{
+    const vec_t quarter = VSET1(0.25);
+    vacc_t acc = VACC_ZERO;
+    accum_t sum = 0.0;
+
+    for (int i = inf_i; i < sup_i; ++i) {
+        int j = inf_j;
+        for (; j + HEAT_VL <= sup_j; j += HEAT_VL) {
+            real_t *p = &u[i*ld+j];
+            vec_t unew = VMUL(quarter, VADD(VADD(VADD(VLOAD(p-1), VLOAD(p+1)),
+                                                 VLOAD(p-ld)), VLOAD(p+ld)));
+            vec_t diff = VSUB(unew, VLOAD(p));
+            acc = VACC(acc, diff);
+            VSTORE(&utmp[i*ld+j], unew);
+        }
+        for (; j < sup_j; ++j) {
+            utmp[i*ld+j] = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                            u[(i-1)*ld+j] + u[(i+1)*ld+j]);
+            real_t diff = utmp[i*ld+j] - u[i*ld+j];
+            sum += (accum_t) diff * diff;
+        }
+    }
+    return sum + VACC_SUM(acc);
+}
+
+/*
+ * Every vector covers both colours: all lanes are computed from the
+ * neighbours, which have the other colour and do not change in this phase,
+ * and only the lanes of the colour being updated are blended into u.
+ */
+static inline double redblack_block_simd(const int ld, real_t *u, int color,
+                                         int inf_i, int sup_i, int inf_j, int sup_j)
+{
+    const vec_t quarter = VSET1(0.25);
+    vacc_t acc = VACC_ZERO;
+    accum_t sum = 0.0;
+
+    for (int i = inf_i; i < sup_i; ++i) {
+        // lane 0 of every vector has the parity of inf_j
+        vmask_t mask = ((i + inf_j + color) & 1) ? VMASK_ODD : VMASK_EVEN;
+        int j = inf_j;
+        for (; j + HEAT_VL <= sup_j; j += HEAT_VL) {
+            real_t *p = &u[i*ld+j];
+            vec_t uold = VLOAD(p);
+            vec_t unew = VMUL(quarter, VADD(VADD(VADD(VLOAD(p-1), VLOAD(p+1)),
+                                                 VLOAD(p-ld)), VLOAD(p+ld)));
+            unew = VSELECT(mask, unew, uold);
+            vec_t diff = VSUB(unew, uold);
+            acc = VACC(acc, diff);
+            VSTORE(p, unew);
+        }
+        for (j += (i + j + color) & 1; j < sup_j; j += 2) {
+            real_t unew = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                           u[(i-1)*ld+j] + u[(i+1)*ld+j]);
+            real_t diff = unew - u[i*ld+j];
+            sum += (accum_t) diff * diff;
+            u[i*ld+j] = unew;
+        }
+    }
+    return sum + VACC_SUM(acc);
+}
+
+static inline accum_t gauss_point(const int ld, real_t *u, int i, int j)
+{
+    real_t unew = (real_t) 0.25 * (u[i*ld+j-1] + u[i*ld+j+1] +
+                                   u[(i-1)*ld+j] + u[(i+1)*ld+j]);
+    real_t diff = unew - u[i*ld+j];
+    u[i*ld+j] = unew;
+    return (accum_t) diff * diff;
+}
+
+/*
+ * Gauss-Seidel along anti-diagonals: HEAT_VL rows are relaxed together with
+ * lane k working on row i0+k, k columns behind lane 0, so the lanes of a
+ * step lie on one anti-diagonal and are independent. The left and upper
+ * neighbours are the previous step's results (the upper one shifted by one
+ * lane), the centre is the previous step's right neighbour, and only the
+ * right and lower neighbours are gathered. The triangles at both ends of a
+ * group of rows, short blocks and the remaining rows run scalar.
+ */
+static inline double gauss_block_simd(const int ld, real_t *u,
+                                      int inf_i, int sup_i, int inf_j, int sup_j)
+{
+    const vec_t quarter = VSET1(0.25);
+    const long stride = ld - 1;    // distance between the lanes
+    const vidx_t idx = VIDX(stride);
+    vacc_t acc = VACC_ZERO;
+    accum_t sum = 0.0;
+    int i0 = inf_i;
+
+    if (sup_j - inf_j >= HEAT_VL) {
+        for (; i0 + HEAT_VL <= sup_i; i0 += HEAT_VL) {
+            int c = inf_j + HEAT_VL - 1;  // column of lane 0 in the first full step
+
+            // leading triangle, row by row
+            for (int k = 0; k < HEAT_VL - 1; ++k)
+                for (int j = inf_j; j < c - k; ++j)
+                    sum += gauss_point(ld, u, i0 + k, j);
+
+            real_t *p = &u[i0*ld + c];   // lane 0's point, lane k at p + k*stride
+            vec_t left = VGATHER(p - 1, idx);
+            vec_t centre = VGATHER(p, idx);
+            for (; c < sup_j; ++c, ++p) {
+                vec_t up = VSHIFT_IN(left, p[-ld]);
+                vec_t right = VGATHER(p + 1, idx);
+                vec_t down = VGATHER(p + ld, idx);
+                vec_t unew = VMUL(quarter, VADD(VADD(VADD(left, right), up), down));
+                vec_t diff = VSUB(unew, centre);
+                acc = VACC(acc, diff);
+                VSCATTER(p, idx, stride, unew);
+                left = unew;
+                centre = right;
+            }
+
+            // trailing triangle, row by row
+            for (int k = 1; k < HEAT_VL; ++k)
+                for (int j = sup_j - k; j < sup_j; ++j)
+                    sum += gauss_point(ld, u, i0 + k, j);
+        }
+    }
+
+    for (int i = i0; i < sup_i; ++i)
+        for (int j = inf_j; j < sup_j; ++j)
+            sum += gauss_point(ld, u, i, j);
+
+    return sum + VACC_SUM(acc);
+}
+
+#else
+
+#define HEAT_VL 1
+
+#endif
+
+#endif // __HEAT_SIMD__
@@ -0,0 +1,321 @@
+//
+// This file is part of Heat Gauss Seidel  and is licensed under the terms contained in the COPYING file.
+// Copyright (C) 2015-2020 Barcelona Supercomputing Center (BSC)
+//
+
+/*
+ * Multi-process runs: the grid is split into horizontal slabs of rows, one
+ * per process, and every process sweeps its slab with the block tasks of
+ * heat.c. A slab has one ghost row above and below its interior rows,
+ * filled from the last interior row of the process above and the first one
+ * of the process below.
+ *
+ * The processes are forked from the first one and share an anonymous
+ * mapping. Each process publishes its first and last interior rows after
+ * every phase (a sweep, or a colour of Red-Black) into a pair of buffers
+ * selected by the parity of the phase, and then stores the phase number in
+ * a sequence counter with release semantics. The neighbours spin on the
+ * counter with acquire loads, so there are no locks: a process can only be
+ * one phase ahead of its neighbours, and two buffers per row are enough.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "heat.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define SLAB_LINE 64
+
+/*
+ * Counters of a process, alone in their cache line so that the spinning
+ * neighbours do not share it with anything else.
+ */
+typedef struct
+{
+    unsigned first, last;   // phases published in the first and last rows
+    unsigned checks;        // residuals published for slab_reduce()
+    unsigned gathered;      // interior copied into the gathered grid
+    double residual[2];     // by parity of checks
+}
+__attribute__((aligned(SLAB_LINE)))
+slab_proc_t;
+
+typedef struct
+{
+    unsigned nprocs;
+    unsigned np, ld;
+    slab_proc_t *proc;      // nprocs counters
+    real_t *rows;           // nprocs x (first, last) x 2 parities x ld
+    real_t *grid;           // whole np x np grid for the image, or NULL
+    size_t len;
+    pid_t pid[];            // children, forked by rank 0
+}
+slab_t;
+
+#define SLAB_ROW(s, rank, last, seq) \
+    ((s)->rows + ((((size_t)(rank) * 2 + (last)) * 2 + ((seq) & 1)) * (s)->ld))
+
+static unsigned slab_load( unsigned *p )
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void slab_store( unsigned *p, unsigned v )
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// with more processes than cores the neighbour has to run to make progress
+static void slab_wait( unsigned *p, unsigned v )
+{
+    while( slab_load(p) < v )
+	sched_yield();
+}
+
+static size_t slab_align( size_t n )
+{
+    return (n + SLAB_LINE - 1) / SLAB_LINE * SLAB_LINE;
+}
+
+/*
+ * Give this process its share of the CPUs it may run on, split into
+ * contiguous ranges so that the processes of a multi-socket node end up one
+ * per socket, and as many threads as CPUs unless OMP_NUM_THREADS says
+ * otherwise. With fewer CPUs than processes they are left shared.
+ */
+static void slab_bind( unsigned rank, unsigned nprocs )
+{
+    cpu_set_t all, mine;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+
+    if( sched_getaffinity(0, sizeof(all), &all) )
+	return;
+    for( int c=0; c<CPU_SETSIZE; c++ )
+	if( CPU_ISSET(c, &all) )
+	    cpus[ncpus++] = c;
+    if( ncpus < nprocs )
+	return;
+
+    int lo = (long)rank * ncpus / nprocs;
+    int hi = (long)(rank + 1) * ncpus / nprocs;
+    CPU_ZERO(&mine);
+    for( int c=lo; c<hi; c++ )
+	CPU_SET(cpus[c], &mine);
+    sched_setaffinity(0, sizeof(mine), &mine);
+
+#ifdef _OPENMP
+    if( !getenv("OMP_NUM_THREADS") )
+	omp_set_num_threads(hi - lo);
+#endif
+}
+
+/*
+ * Split param->resolution rows among nprocs processes and fork them. Every
+ * process returns with param->rank, param->row0 and param->rows set to its
+ * slab; the slabs have an even number of rows, except the last, so that the
+ * Red-Black colours of the local and global indices agree. Must be called
+ * before any OpenMP parallel region. Returns 0 on failure.
+ */
+int slab_start( algoparam_t *param, unsigned nprocs )
+{
+    unsigned n = param->resolution;
+    unsigned np = n + 2;
+    unsigned ld = GRID_PITCH(np);
+    unsigned chunk = (n / nprocs + 1) & ~1u;
+
+    param->nprocs = nprocs;
+    param->rank = 0;
+    param->row0 = 0;
+    param->rows = n;
+    param->slab = NULL;
+    if( nprocs <= 1 )
+	return 1;
+
+    if( (nprocs - 1) * chunk >= n )
+    {
+	fprintf(stderr, "Error: %u rows are too few for %u processes\n", n, nprocs);
+	return 0;
+    }
+
+    size_t head = slab_align(sizeof(slab_t) + nprocs * sizeof(pid_t));
+    size_t procs = slab_align(nprocs * sizeof(slab_proc_t));
+    size_t rows = (size_t)nprocs * 4 * ld * sizeof(real_t);
+    size_t grid = param->visres ? (size_t)np * ld * sizeof(real_t) : 0;
+    size_t len = head + procs + rows + grid;
+
+    void *map = mmap(0, len, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if( map == MAP_FAILED )
+    {
+	perror("mmap");
+	return 0;
+    }
+
+    // the mapping is zeroed, so all the counters start at phase 0
+    slab_t *s = (slab_t *)map;
+    s->nprocs = nprocs;
+    s->np = np;
+    s->ld = ld;
+    s->proc = (slab_proc_t *)((char *)map + head);
+    s->rows = (real_t *)((char *)map + head + procs);
+    s->grid = grid ? (real_t *)((char *)map + head + procs + rows) : NULL;
+    s->len = len;
+    param->slab = s;
+
+    // the children would flush the buffered output once more
+    fflush(stdout);
+    fflush(stderr);
+
+    unsigned rank;
+    for( rank=1; rank<nprocs; rank++ )
+    {
+	pid_t pid = fork();
+	if( pid < 0 )
+	{
+	    perror("fork");
+	    return 0;
+	}
+	if( pid == 0 )
+	    break;
+	s->pid[rank] = pid;
+    }
+    if( rank == nprocs )
+	rank = 0;
+
+    param->rank = rank;
+    param->row0 = rank * chunk;
+    param->rows = (rank == nprocs - 1) ? n - rank * chunk : chunk;
+    slab_bind(rank, nprocs);
+
+    return 1;
+}
+
+/*
+ * Fill the ghost rows of u with the last row of the process above after
+ * top phases and the first row of the process below after bottom phases,
+ * waiting for them to be published. A count of 0 keeps the ghost row.
+ */
+void slab_halo( algoparam_t *param, real_t *u, unsigned top, unsigned bottom )
+{
+    slab_t *s = (slab_t *)param->slab;
+    unsigned rank = param->rank;
+    unsigned nx = param->rows + 2;
+
+    if( rank > 0 && top > 0 )
+    {
+	slab_wait(&s->proc[rank-1].last, top);
+	memcpy(u, SLAB_ROW(s, rank-1, 1, top), s->np * sizeof(real_t));
+    }
+    if( rank < s->nprocs - 1 && bottom > 0 )
+    {
+	slab_wait(&s->proc[rank+1].first, bottom);
+	memcpy(&u[(nx-1)*s->ld], SLAB_ROW(s, rank+1, 0, bottom), s->np * sizeof(real_t));
+    }
+}
+
+/*
+ * Publish the rows of u selected by which (SLAB_FIRST, SLAB_LAST) as the
+ * state after seq phases. Only the rows a neighbour reads are copied.
+ */
+void slab_publish( algoparam_t *param, real_t *u, int which, unsigned seq )
+{
+    slab_t *s = (slab_t *)param->slab;
+    unsigned rank = param->rank;
+
+    if( (which & SLAB_FIRST) && rank > 0 )
+    {
+	memcpy(SLAB_ROW(s, rank, 0, seq), &u[s->ld], s->np * sizeof(real_t));
+	slab_store(&s->proc[rank].first, seq);
+    }
+    if( (which & SLAB_LAST) && rank < s->nprocs - 1 )
+    {
+	memcpy(SLAB_ROW(s, rank, 1, seq), &u[param->rows*s->ld], s->np * sizeof(real_t));
+	slab_store(&s->proc[rank].last, seq);
+    }
+}
+
+/*
+ * Sum residual over the processes. Every process must call it the same
+ * number of times; it also works as a barrier. The sum is taken in rank
+ * order, so all the processes get the same value and take the same
+ * convergence decisions.
+ */
+double slab_reduce( algoparam_t *param, double residual )
+{
+    slab_t *s = (slab_t *)param->slab;
+    slab_proc_t *me = &s->proc[param->rank];
+    unsigned check = me->checks + 1;
+    double sum = 0.0;
+
+    me->residual[check & 1] = residual;
+    slab_store(&me->checks, check);
+
+    for( unsigned p=0; p<s->nprocs; p++ )
+    {
+	slab_wait(&s->proc[p].checks, check);
+	sum += s->proc[p].residual[check & 1];
+    }
+    return sum;
+}
+
+/*
+ * Copy the slab of u into the shared whole grid. Rank 0 waits for all the
+ * slabs and gets the grid, with pitch GRID_PITCH(resolution+2); the other
+ * processes get NULL.
+ */
+real_t *slab_gather( algoparam_t *param, real_t *u )
+{
+    slab_t *s = (slab_t *)param->slab;
+    unsigned rank = param->rank;
+    unsigned first = (rank == 0) ? 0 : 1;
+    unsigned last = (rank == s->nprocs - 1) ? param->rows + 1 : param->rows;
+
+    if( !s->grid )
+	return NULL;
+
+    memcpy(&s->grid[(param->row0 + first) * s->ld], &u[first * s->ld],
+	   (size_t)(last - first + 1) * s->ld * sizeof(real_t));
+    slab_store(&s->proc[rank].gathered, 1);
+
+    if( rank > 0 )
+	return NULL;
+    for( unsigned p=1; p<s->nprocs; p++ )
+	slab_wait(&s->proc[p].gathered, 1);
+    return s->grid;
+}
+
+/*
+ * Rank 0 waits for the other processes to exit. Returns 0 if any of them
+ * failed.
+ */
+int slab_finish( algoparam_t *param )
+{
+    slab_t *s = (slab_t *)param->slab;
+    int ok = 1;
+
+    if( !s )
+	return 1;
+
+    if( param->rank == 0 )
+	for( unsigned p=1; p<s->nprocs; p++ )
+	{
+	    int status;
+	    if( waitpid(s->pid[p], &status, 0) < 0 ||
+		!WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+		ok = 0;
+	}
+
+    munmap(s, s->len);
+    param->slab = NULL;
+    return ok;
+}